@@ -1,5 +1,5 @@
 // realistic_auth_sim.cpp
-// Compile: g++ -std=c++17 tps.cpp -lcryptopp -O2 -pthread -o tps
+// Compile: g++ -std=c++20 tps.cpp -lcryptopp -O2 -pthread -o tps
 // run using ./tps
 // listing all the optional params -> ./tps --nodes 200 --workers 4 --tamper-percent 1 --payload-bytes 512 --node-jitter 100 --net-ta-node 10 50 --net-node-mw 10 50 --db-delay 20 60 --fail-percent 3 --out results.csv
 
@@ -7,25 +7,46 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <array>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
 #include <numeric>
+#include <cmath>
 #include <random>
 #include <cstring>
+#include <cstdio>
 #include <cstdlib>
+#include <queue>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <condition_variable>
+#include <coroutine>
+#include <span>
+#include <stdexcept>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <cryptopp/aes.h>
 #include <cryptopp/modes.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/cmac.h>
 #include <cryptopp/filters.h>
 #include <cryptopp/hex.h>
 #include <cryptopp/osrng.h>
 #include <cryptopp/sha.h>
+#include <cryptopp/hkdf.h>
 #include <cryptopp/secblock.h>
+#include <cryptopp/cpu.h>
 
 using std::string;
 using std::cout;
@@ -33,15 +54,328 @@ using std::cerr;
 using std::endl;
 using CryptoPP::byte;
 
+// ---------- Heap allocation counter ----------
+// Global operator new counts into a per-thread counter, so a worker can read how many
+// allocations its own request step made without contending on a shared cache line.
+thread_local unsigned long long t_heap_allocs = 0;
+
+// noinline keeps GCC from pairing the inlined malloc/free against new/delete call sites
+__attribute__((noinline)) void *operator new(std::size_t n) {
+    ++t_heap_allocs;
+    if (void *p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+// Heap allocations fn makes on this thread
+template <typename F>
+unsigned long long count_allocs(F &&fn) {
+    unsigned long long before = t_heap_allocs;
+    fn();
+    return t_heap_allocs - before;
+}
+
+// ---------- CPU features and kernel dispatch ----------
+// Detected once at startup. Each kernel below picks its fastest implementation for the
+// running CPU: AES and GHASH inside Crypto++ (AES-NI, PCLMUL), hex in this file (AVX2,
+// SSE2). g_force_scalar turns all of them off to model gateways without AES hardware;
+// it has to be applied (force_scalar_kernels) before the first cipher is keyed.
+struct CpuFeatures {
+    bool aesni = false, pclmul = false, sse41 = false, avx2 = false, avx512f = false, avx512bw = false;
+};
+
+bool g_force_scalar = false;
+
+const CpuFeatures &cpu_features() {
+    static const CpuFeatures f = [] {
+        CpuFeatures c;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        c.aesni = __builtin_cpu_supports("aes");
+        c.pclmul = __builtin_cpu_supports("pclmul");
+        c.sse41 = __builtin_cpu_supports("sse4.1");
+        c.avx2 = __builtin_cpu_supports("avx2");
+        c.avx512f = __builtin_cpu_supports("avx512f");
+        c.avx512bw = __builtin_cpu_supports("avx512bw");
+#endif
+        return c;
+    }();
+    return f;
+}
+
+// Crypto++ dispatches on its own detection flags, read at key setup and per call;
+// clearing them sends AES to the table implementation and GHASH to the portable one
+void force_scalar_kernels() {
+    g_force_scalar = true;
+#if defined(__x86_64__) || defined(__i386__)
+    CryptoPP::HasAESNI();   // runs detection first, so it can't overwrite the flags later
+    CryptoPP::g_hasAESNI = false;
+    CryptoPP::g_hasCLMUL = false;
+    CryptoPP::g_hasSSSE3 = false;
+    CryptoPP::g_hasSSE41 = false;
+    CryptoPP::g_hasSSE42 = false;
+    CryptoPP::g_hasAVX = false;
+    CryptoPP::g_hasAVX2 = false;
+    CryptoPP::g_hasSHA = false;
+#endif
+}
+
+string cpu_features_line() {
+    const CpuFeatures &f = cpu_features();
+    auto yn = [](bool b) { return b ? "yes" : "no"; };
+    std::ostringstream os;
+    os << "aes-ni " << yn(f.aesni) << ", pclmul " << yn(f.pclmul) << ", sse4.1 " << yn(f.sse41)
+       << ", avx2 " << yn(f.avx2) << ", avx-512f " << yn(f.avx512f) << ", avx-512bw " << yn(f.avx512bw);
+    return os.str();
+}
+
 // ---------- Helpers: hex encode/decode ----------
+// Span-based kernels writing into caller buffers, lowercase output. The best kernel
+// for the running CPU is picked once at first use (AVX-512BW > AVX2 > SSE2 > scalar, or scalar
+// under g_force_scalar).
+struct HexKernel {
+    const char* name;
+    void (*encode)(const byte *in, size_t n, char *out);          // writes 2*n chars
+    bool (*decode)(const char *in, size_t n_pairs, byte *out);    // false on a non-hex char
+};
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+inline int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = (char)(c | 0x20);
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+void hex_encode_scalar(const byte *in, size_t n, char *out) {
+    for (size_t i = 0; i < n; ++i) {
+        out[2*i]     = HEX_DIGITS[in[i] >> 4];
+        out[2*i + 1] = HEX_DIGITS[in[i] & 0x0f];
+    }
+}
+
+bool hex_decode_scalar(const char *in, size_t n_pairs, byte *out) {
+    for (size_t i = 0; i < n_pairs; ++i) {
+        int hi = hex_value(in[2*i]), lo = hex_value(in[2*i + 1]);
+        if ((hi | lo) < 0) return false;
+        out[i] = (byte)((hi << 4) | lo);
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TPS_HEX_X86 1
+
+// nibbles (0..15) -> ascii '0'..'9','a'..'f'
+inline __m128i hex_nibbles_to_ascii_sse2(__m128i n) {
+    __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+void hex_encode_sse2(const byte *in, size_t n, char *out) {
+    const __m128i low4 = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i hi = hex_nibbles_to_ascii_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), low4));
+        __m128i lo = hex_nibbles_to_ascii_sse2(_mm_and_si128(v, low4));
+        _mm_storeu_si128((__m128i*)(out + 2*i),      _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    hex_encode_scalar(in + i, n - i, out + 2*i);
+}
+
+// 16 ascii chars -> 16 nibble values; clears *ok if any char is not hex
+inline __m128i hex_ascii_to_nibbles_sse2(__m128i c, int &ok) {
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i d_ok = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i l_ok = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+    ok &= (_mm_movemask_epi8(_mm_or_si128(d_ok, l_ok)) == 0xffff);
+    return _mm_or_si128(_mm_and_si128(d_ok, d), _mm_and_si128(l_ok, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// Each 16-bit lane holds (hi, lo) nibbles; fold to (hi << 4 | lo) in the low byte
+inline __m128i hex_fold_pairs_sse2(__m128i v) {
+    return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00f0)), _mm_srli_epi16(v, 8));
+}
+
+bool hex_decode_sse2(const char *in, size_t n_pairs, byte *out) {
+    size_t i = 0;
+    int ok = 1;
+    for (; i + 16 <= n_pairs; i += 16) {
+        __m128i a = hex_ascii_to_nibbles_sse2(_mm_loadu_si128((const __m128i*)(in + 2*i)), ok);
+        __m128i b = hex_ascii_to_nibbles_sse2(_mm_loadu_si128((const __m128i*)(in + 2*i + 16)), ok);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(hex_fold_pairs_sse2(a), hex_fold_pairs_sse2(b)));
+    }
+    return ok && hex_decode_scalar(in + 2*i, n_pairs - i, out + i);
+}
+
+__attribute__((target("avx2")))
+inline __m256i hex_nibbles_to_ascii_avx2(__m256i n) {
+    __m256i letter = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+    return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), _mm256_and_si256(letter, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("avx2")))
+void hex_encode_avx2(const byte *in, size_t n, char *out) {
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v  = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi = hex_nibbles_to_ascii_avx2(_mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+        __m256i lo = hex_nibbles_to_ascii_avx2(_mm256_and_si256(v, low4));
+        // unpack works per 128-bit lane; permute restores byte order
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*)(out + 2*i),      _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 2*i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    hex_encode_sse2(in + i, n - i, out + 2*i);
+}
+
+__attribute__((target("avx2")))
+inline __m256i hex_ascii_to_nibbles_avx2(__m256i c, int &ok) {
+    __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i d_ok = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i l_ok = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+    ok &= (_mm256_movemask_epi8(_mm256_or_si256(d_ok, l_ok)) == -1);
+    return _mm256_or_si256(_mm256_and_si256(d_ok, d), _mm256_and_si256(l_ok, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+bool hex_decode_avx2(const char *in, size_t n_pairs, byte *out) {
+    const __m256i mask = _mm256_set1_epi16(0x00f0);
+    size_t i = 0;
+    int ok = 1;
+    for (; i + 32 <= n_pairs; i += 32) {
+        __m256i a = hex_ascii_to_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(in + 2*i)), ok);
+        __m256i b = hex_ascii_to_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(in + 2*i + 32)), ok);
+        a = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(a, 4), mask), _mm256_srli_epi16(a, 8));
+        b = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(b, 4), mask), _mm256_srli_epi16(b, 8));
+        // packus interleaves 128-bit lanes; 0xD8 puts them back in order
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+    }
+    return ok && hex_decode_sse2(in + 2*i, n_pairs - i, out + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i hex_nibbles_to_ascii_avx512(__m512i n) {
+    __mmask64 letter = _mm512_cmpgt_epu8_mask(n, _mm512_set1_epi8(9));
+    return _mm512_mask_add_epi8(_mm512_add_epi8(n, _mm512_set1_epi8('0')), letter,
+                                _mm512_add_epi8(n, _mm512_set1_epi8('0')), _mm512_set1_epi8('a' - '0' - 10));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void hex_encode_avx512(const byte *in, size_t n, char *out) {
+    const __m512i low4 = _mm512_set1_epi8(0x0f);
+    // unpack works per 128-bit lane; these put the lanes back in byte order
+    const __m512i first = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i second = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i v  = _mm512_loadu_si512((const void*)(in + i));
+        __m512i hi = hex_nibbles_to_ascii_avx512(_mm512_and_si512(_mm512_srli_epi16(v, 4), low4));
+        __m512i lo = hex_nibbles_to_ascii_avx512(_mm512_and_si512(v, low4));
+        __m512i a = _mm512_unpacklo_epi8(hi, lo);
+        __m512i b = _mm512_unpackhi_epi8(hi, lo);
+        _mm512_storeu_si512((void*)(out + 2*i),      _mm512_permutex2var_epi64(a, first, b));
+        _mm512_storeu_si512((void*)(out + 2*i + 64), _mm512_permutex2var_epi64(a, second, b));
+    }
+    hex_encode_avx2(in + i, n - i, out + 2*i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i hex_ascii_to_nibbles_avx512(__m512i c, __mmask64 &bad) {
+    __m512i d = _mm512_sub_epi8(c, _mm512_set1_epi8('0'));
+    __m512i l = _mm512_sub_epi8(_mm512_or_si512(c, _mm512_set1_epi8(0x20)), _mm512_set1_epi8('a'));
+    __mmask64 d_ok = _mm512_cmple_epu8_mask(d, _mm512_set1_epi8(9));
+    __mmask64 l_ok = _mm512_cmple_epu8_mask(l, _mm512_set1_epi8(5));
+    bad |= ~(d_ok | l_ok);
+    return _mm512_mask_blend_epi8(d_ok, _mm512_add_epi8(l, _mm512_set1_epi8(10)), d);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+bool hex_decode_avx512(const char *in, size_t n_pairs, byte *out) {
+    const __m512i mask = _mm512_set1_epi16(0x00f0);
+    size_t i = 0;
+    __mmask64 bad = 0;
+    for (; i + 64 <= n_pairs; i += 64) {
+        __m512i a = hex_ascii_to_nibbles_avx512(_mm512_loadu_si512((const void*)(in + 2*i)), bad);
+        __m512i b = hex_ascii_to_nibbles_avx512(_mm512_loadu_si512((const void*)(in + 2*i + 64)), bad);
+        a = _mm512_or_si512(_mm512_and_si512(_mm512_slli_epi16(a, 4), mask), _mm512_srli_epi16(a, 8));
+        b = _mm512_or_si512(_mm512_and_si512(_mm512_slli_epi16(b, 4), mask), _mm512_srli_epi16(b, 8));
+        // narrowing each 16-bit lane to its low byte keeps byte order, unlike packus
+        // (maskz form: the unmasked one trips -Wmaybe-uninitialized in GCC 12)
+        _mm256_storeu_si256((__m256i*)(out + i),      _mm512_maskz_cvtepi16_epi8(~0u, a));
+        _mm256_storeu_si256((__m256i*)(out + i + 32), _mm512_maskz_cvtepi16_epi8(~0u, b));
+    }
+    return bad == 0 && hex_decode_avx2(in + 2*i, n_pairs - i, out + i);
+}
+#endif
+
+// Kernels usable on this CPU, best last
+std::vector<HexKernel> hex_kernels_available() {
+    std::vector<HexKernel> ks{{"scalar", hex_encode_scalar, hex_decode_scalar}};
+#ifdef TPS_HEX_X86
+    ks.push_back({"sse2", hex_encode_sse2, hex_decode_sse2});
+    if (cpu_features().avx2) ks.push_back({"avx2", hex_encode_avx2, hex_decode_avx2});
+    if (cpu_features().avx2 && cpu_features().avx512bw) ks.push_back({"avx512bw", hex_encode_avx512, hex_decode_avx512});
+#endif
+    return ks;
+}
+
+const HexKernel &hex_kernel() {
+    static const HexKernel k = g_force_scalar ? hex_kernels_available().front() : hex_kernels_available().back();
+    return k;
+}
+
+// out.size() must be >= 2 * in.size()
+void hex_encode(std::span<const byte> in, std::span<char> out) {
+    if (out.size() < 2 * in.size()) throw std::length_error("hex_encode: output too small");
+    hex_kernel().encode(in.data(), in.size(), out.data());
+}
+
+// out.size() must be >= in.size() / 2; false on odd length or a non-hex char
+bool hex_decode(std::span<const char> in, std::span<byte> out) {
+    if (in.size() % 2 != 0 || out.size() < in.size() / 2) return false;
+    return hex_kernel().decode(in.data(), in.size() / 2, out.data());
+}
+
 string toHex(const string &input) {
+    string output(2 * input.size(), '\0');
+    hex_encode({(const byte*)input.data(), input.size()}, output);
+    return output;
+}
+
+string fromHex(const string &hex) {
+    string output(hex.size() / 2, '\0');
+    if (!hex_decode(hex, {(byte*)output.data(), output.size()})) throw std::runtime_error("Bad hex encoding");
+    return output;
+}
+
+// Kernels aesEncryptHex/aesDecryptHex/toHex/fromHex run on, as Crypto++ and hex_kernel() picked them
+string kernel_selection_line() {
+    std::ostringstream os;
+    os << "aes " << (CryptoPP::HasAESNI() ? "aes-ni" : "table") << ", ghash " << (CryptoPP::HasCLMUL() ? "pclmul" : "table")
+       << ", hex " << hex_kernel().name;
+    if (g_force_scalar) os << " (forced scalar)";
+    return os.str();
+}
+
+// Previous Crypto++ filter-pipeline helpers, kept as the --bench hex baseline
+string toHexPipeline(const string &input) {
     std::string output;
     CryptoPP::StringSource ss(input, true,
         new CryptoPP::HexEncoder(new CryptoPP::StringSink(output), false));
     return output;
 }
 
-string fromHex(const string &hex) {
+string fromHexPipeline(const string &hex) {
     std::string output;
     CryptoPP::StringSource ss(hex, true,
         new CryptoPP::HexDecoder(new CryptoPP::StringSink(output)));
@@ -57,44 +391,747 @@ CryptoPP::SecByteBlock deriveKey(const string &passphrase) {
     return key;
 }
 
+// ---------- Per-thread crypto context ----------
+// One per thread: a DRBG seeded once and reseeded every RESEED_INTERVAL draws, and
+// pre-keyed CBC/GCM/CMAC objects so a message under a key the thread has seen recently
+// costs an IV reset instead of a key schedule. With per-node keys a node's first message
+// on a thread still pays one key schedule, for the one object it uses.
+// g_use_crypto_ctx = false restores the old per-call RNG + SetKeyWithIV path.
+bool g_use_crypto_ctx = true;
+
+class CryptoContext {
+public:
+    using Enc = CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption;
+    using Dec = CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption;
+    using GcmEnc = CryptoPP::GCM<CryptoPP::AES>::Encryption;
+    using GcmDec = CryptoPP::GCM<CryptoPP::AES>::Decryption;
+    using Cmac = CryptoPP::CMAC<CryptoPP::AES>;
+
+    static CryptoContext &local() {
+        thread_local CryptoContext ctx;
+        return ctx;
+    }
+
+    void random_block(byte *out, size_t n) {
+        if (++draws_since_reseed_ >= RESEED_INTERVAL) {
+            rng_.Reseed();
+            draws_since_reseed_ = 0;
+        }
+        rng_.GenerateBlock(out, n);
+    }
+
+    Enc &encryptor(const CryptoPP::SecByteBlock &key, const byte *iv) {
+        Slot &s = slot_for(key);
+        if (s.enc_keyed) {
+            s.enc.Resynchronize(iv);
+        } else {
+            s.enc.SetKeyWithIV(key, key.size(), iv);
+            s.enc_keyed = true;
+            ++key_setups_;
+        }
+        return s.enc;
+    }
+
+    Dec &decryptor(const CryptoPP::SecByteBlock &key, const byte *iv) {
+        Slot &s = slot_for(key);
+        if (s.dec_keyed) {
+            s.dec.Resynchronize(iv);
+        } else {
+            s.dec.SetKeyWithIV(key, key.size(), iv);
+            s.dec_keyed = true;
+            ++key_setups_;
+        }
+        return s.dec;
+    }
+
+    // GCM objects take the nonce per call (EncryptAndAuthenticate / DecryptAndVerify).
+    // Keying one also builds its GHASH tables, so each direction is keyed only when used.
+    GcmEnc &gcm_encryptor(const CryptoPP::SecByteBlock &key) {
+        Slot &s = slot_for(key);
+        if (!s.gcm_enc_keyed) {
+            byte zero_iv[CryptoPP::AES::BLOCKSIZE] = {0};
+            s.gcm_enc.SetKeyWithIV(key, key.size(), zero_iv, 12);
+            s.gcm_enc_keyed = true;
+            ++key_setups_;
+        }
+        return s.gcm_enc;
+    }
+
+    GcmDec &gcm_decryptor(const CryptoPP::SecByteBlock &key) {
+        Slot &s = slot_for(key);
+        if (!s.gcm_dec_keyed) {
+            byte zero_iv[CryptoPP::AES::BLOCKSIZE] = {0};
+            s.gcm_dec.SetKeyWithIV(key, key.size(), zero_iv, 12);
+            s.gcm_dec_keyed = true;
+            ++key_setups_;
+        }
+        return s.gcm_dec;
+    }
+
+    Cmac &cmac(const CryptoPP::SecByteBlock &key) {
+        Slot &s = slot_for(key);
+        if (!s.cmac_keyed) {
+            s.cmac.SetKey(key, key.size());
+            s.cmac_keyed = true;
+            ++key_setups_;
+        }
+        return s.cmac;
+    }
+
+    // Key schedules run by this thread's context so far (benches report them per op)
+    uint64_t key_setups() const { return key_setups_; }
+
+private:
+    static constexpr unsigned RESEED_INTERVAL = 1u << 16;
+    // 64 sets x 4 ways: the three shared keys plus the per-node keys of the sessions a
+    // thread has in flight (two per node), least recently used evicted within a set
+    static constexpr size_t SETS = 64, WAYS = 4;
+
+    struct Slot {
+        CryptoPP::SecByteBlock key;
+        uint64_t last_use = 0;
+        Enc enc;
+        Dec dec;
+        GcmEnc gcm_enc;
+        GcmDec gcm_dec;
+        Cmac cmac;
+        bool enc_keyed = false, dec_keyed = false, gcm_enc_keyed = false, gcm_dec_keyed = false, cmac_keyed = false;
+    };
+
+    // Keys are matched by value, so a slot stays valid if a key global is reassigned, and a
+    // rotated node key lands in a fresh slot. Keys are SHA-256/HKDF output, so their first
+    // bytes pick the set.
+    Slot &slot_for(const CryptoPP::SecByteBlock &key) {
+        uint64_t h = 0;
+        std::memcpy(&h, key.begin(), std::min<size_t>(key.size(), sizeof(h)));
+        auto &set = sets_[(h ^ (h >> 32)) % SETS];
+        std::unique_ptr<Slot> *victim = &set[0];   // an empty way, else the least recently used
+        for (auto &way : set) {
+            if (way && way->key == key) {
+                way->last_use = ++uses_;
+                return *way;
+            }
+            if (!way) {
+                if (*victim) victim = &way;
+            } else if (*victim && way->last_use < (*victim)->last_use) {
+                victim = &way;
+            }
+        }
+        // Only the key changes; the cipher objects are re-keyed as they are next used
+        if (!*victim) *victim = std::make_unique<Slot>();
+        Slot &s = **victim;
+        s.key = key;
+        s.last_use = ++uses_;
+        s.enc_keyed = s.dec_keyed = s.gcm_enc_keyed = s.gcm_dec_keyed = s.cmac_keyed = false;
+        return s;
+    }
+
+    CryptoPP::AutoSeededRandomPool rng_;
+    unsigned draws_since_reseed_ = 0;
+    std::array<std::unique_ptr<Slot>, WAYS> sets_[SETS];
+    uint64_t uses_ = 0, key_setups_ = 0;
+};
+
+void random_block(byte *out, size_t n) {
+    if (g_use_crypto_ctx) {
+        CryptoContext::local().random_block(out, n);
+    } else {
+        CryptoPP::AutoSeededRandomPool rng;
+        rng.GenerateBlock(out, n);
+    }
+}
+
+// ---------- Per-worker arena ----------
+// Bump allocator behind the per-request buffers on the hot path, one per thread. An
+// ArenaScope rewinds it when the synchronous step that used it ends, so coroutines
+// sharing a thread never hold arena memory across a suspension point.
+// g_use_arena = false restores the string-per-step path.
+bool g_use_arena = true;
+
+class Arena {
+public:
+    static Arena &local() {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    std::span<byte> alloc(size_t n) {
+        size_t at = (used_ + ALIGN - 1) & ~(ALIGN - 1);
+        if (at + n > cap_) {
+            // Outstanding spans keep pointing into the old chunk until the outermost scope ends
+            if (buf_) retired_.push_back(std::move(buf_));
+            cap_ = std::max(cap_ * 2, std::max(n, INITIAL_BYTES));
+            buf_ = std::make_unique<byte[]>(cap_);
+            at = 0;
+        }
+        used_ = at + n;
+        return {buf_.get() + at, n};
+    }
+
+    size_t mark() const { return used_; }
+
+    void rewind(size_t mark) {
+        used_ = mark;
+        if (mark == 0) retired_.clear();
+    }
+
+    size_t capacity() const { return cap_; }
+
+private:
+    static constexpr size_t ALIGN = 16;
+    static constexpr size_t INITIAL_BYTES = 64 * 1024;
+
+    std::unique_ptr<byte[]> buf_;
+    size_t cap_ = 0, used_ = 0;
+    std::vector<std::unique_ptr<byte[]>> retired_;
+};
+
+class ArenaScope {
+public:
+    ArenaScope() : arena_(Arena::local()), mark_(arena_.mark()) {}
+    ~ArenaScope() { arena_.rewind(mark_); }
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+    std::span<byte> alloc(size_t n) {
+        bytes_ += n;
+        return arena_.alloc(n);
+    }
+
+    size_t bytes() const { return bytes_; }   // handed out by this scope
+
+private:
+    Arena &arena_;
+    size_t mark_;
+    size_t bytes_ = 0;
+};
+
 // ---------- AES-CBC encrypt/decrypt with random IV ----------
-string aesEncryptHex(const CryptoPP::SecByteBlock &key, const string &plain) {
-    CryptoPP::AutoSeededRandomPool rng;
-    byte iv[CryptoPP::AES::BLOCKSIZE];
-    rng.GenerateBlock(iv, sizeof(iv));
+// padded = false is for fixed-size records that are already a whole number of blocks
+CryptoPP::StreamTransformationFilter::BlockPaddingScheme cbc_padding(bool padded) {
+    return padded ? CryptoPP::StreamTransformationFilter::DEFAULT_PADDING : CryptoPP::StreamTransformationFilter::NO_PADDING;
+}
+
+string aesEncryptRaw(const CryptoPP::SecByteBlock &key, const byte *iv, const string &plain, bool padded = true) {
     std::string cipher;
-    CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption enc;
-    enc.SetKeyWithIV(key, key.size(), iv);
-    CryptoPP::StringSource ss(plain, true,
-        new CryptoPP::StreamTransformationFilter(enc, new CryptoPP::StringSink(cipher))
-    );
-    string ivhex = toHex(string((const char*)iv, sizeof(iv)));
-    string chex  = toHex(cipher);
-    return ivhex + ":" + chex;
+    if (g_use_crypto_ctx) {
+        CryptoPP::StringSource ss(plain, true,
+            new CryptoPP::StreamTransformationFilter(CryptoContext::local().encryptor(key, iv), new CryptoPP::StringSink(cipher), cbc_padding(padded))
+        );
+    } else {
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption enc;
+        enc.SetKeyWithIV(key, key.size(), iv);
+        CryptoPP::StringSource ss(plain, true,
+            new CryptoPP::StreamTransformationFilter(enc, new CryptoPP::StringSink(cipher), cbc_padding(padded))
+        );
+    }
+    return cipher;
+}
+
+string aesDecryptRaw(const CryptoPP::SecByteBlock &key, const byte *iv, const byte *cipher, size_t len, bool padded = true) {
+    std::string recovered;
+    if (g_use_crypto_ctx) {
+        CryptoPP::StringSource ss(cipher, len, true,
+            new CryptoPP::StreamTransformationFilter(CryptoContext::local().decryptor(key, iv), new CryptoPP::StringSink(recovered), cbc_padding(padded))
+        );
+    } else {
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption dec;
+        dec.SetKeyWithIV(key, key.size(), iv);
+        CryptoPP::StringSource ss(cipher, len, true,
+            new CryptoPP::StreamTransformationFilter(dec, new CryptoPP::StringSink(recovered), cbc_padding(padded))
+        );
+    }
+    return recovered;
+}
+
+// ---------- AES-GCM (AEAD) encrypt/decrypt ----------
+// 12-byte nonce, 16-byte tag appended to the ciphertext; aad is authenticated, not sent.
+constexpr size_t GCM_NONCE_BYTES = 12;
+constexpr size_t GCM_TAG_BYTES = 16;
+
+string aesGcmEncryptRaw(const CryptoPP::SecByteBlock &key, const byte *nonce, const string &plain, const string &aad) {
+    string out(plain.size() + GCM_TAG_BYTES, '\0');
+    byte *ct = (byte*)&out[0];
+    auto seal = [&](CryptoPP::GCM<CryptoPP::AES>::Encryption &enc) {
+        enc.EncryptAndAuthenticate(ct, ct + plain.size(), GCM_TAG_BYTES, nonce, GCM_NONCE_BYTES,
+                                   (const byte*)aad.data(), aad.size(), (const byte*)plain.data(), plain.size());
+    };
+    if (g_use_crypto_ctx) {
+        seal(CryptoContext::local().gcm_encryptor(key));
+    } else {
+        CryptoPP::GCM<CryptoPP::AES>::Encryption enc;
+        enc.SetKeyWithIV(key, key.size(), nonce, GCM_NONCE_BYTES);
+        seal(enc);
+    }
+    return out;
+}
+
+string aesGcmDecryptRaw(const CryptoPP::SecByteBlock &key, const byte *nonce, const byte *cipher, size_t len, const string &aad) {
+    if (len < GCM_TAG_BYTES) throw std::runtime_error("Short GCM ciphertext");
+    size_t n = len - GCM_TAG_BYTES;
+    string out(n, '\0');
+    auto open = [&](CryptoPP::GCM<CryptoPP::AES>::Decryption &dec) {
+        return dec.DecryptAndVerify((byte*)&out[0], cipher + n, GCM_TAG_BYTES, nonce, GCM_NONCE_BYTES,
+                                    (const byte*)aad.data(), aad.size(), cipher, n);
+    };
+    bool ok;
+    if (g_use_crypto_ctx) {
+        ok = open(CryptoContext::local().gcm_decryptor(key));
+    } else {
+        CryptoPP::GCM<CryptoPP::AES>::Decryption dec;
+        dec.SetKeyWithIV(key, key.size(), nonce, GCM_NONCE_BYTES);
+        ok = open(dec);
+    }
+    if (!ok) throw std::runtime_error("GCM authentication failed");
+    return out;
+}
+
+// ---------- Cipher mode selection (--cipher cbc|gcm) ----------
+enum class CipherMode { Cbc, Gcm };
+CipherMode g_cipher_mode = CipherMode::Cbc;
+
+const char* cipher_mode_name(CipherMode c) {
+    return c == CipherMode::Gcm ? "gcm" : "cbc";
+}
+
+size_t iv_bytes(CipherMode mode) {
+    return mode == CipherMode::Gcm ? GCM_NONCE_BYTES : (size_t)CryptoPP::AES::BLOCKSIZE;
+}
+
+// CBC ignores aad; GCM binds it into the tag. GCM never pads, so padded only affects CBC.
+string aesSealRaw(CipherMode mode, const CryptoPP::SecByteBlock &key, const byte *iv, const string &plain, const string &aad, bool padded = true) {
+    return mode == CipherMode::Gcm ? aesGcmEncryptRaw(key, iv, plain, aad) : aesEncryptRaw(key, iv, plain, padded);
+}
+
+string aesOpenRaw(CipherMode mode, const CryptoPP::SecByteBlock &key, const byte *iv, const byte *cipher, size_t len, const string &aad, bool padded = true) {
+    return mode == CipherMode::Gcm ? aesGcmDecryptRaw(key, iv, cipher, len, aad) : aesDecryptRaw(key, iv, cipher, len, padded);
 }
 
-string aesDecryptHex(const CryptoPP::SecByteBlock &key, const string &combined) {
+// ---------- AES into caller buffers ----------
+// Same bytes as aesSealRaw/aesOpenRaw, but the mode objects run directly on caller spans:
+// no filter chain and no strings. CBC padding is PKCS#7, done here.
+size_t sealed_bytes(CipherMode mode, size_t plain_len, bool padded) {
+    if (mode == CipherMode::Gcm) return plain_len + GCM_TAG_BYTES;
+    return padded ? (plain_len / CryptoPP::AES::BLOCKSIZE + 1) * CryptoPP::AES::BLOCKSIZE : plain_len;
+}
+
+size_t aesSealInto(CipherMode mode, const CryptoPP::SecByteBlock &key, const byte *iv, std::span<const byte> plain,
+                   const string &aad, bool padded, std::span<byte> out) {
+    size_t n = sealed_bytes(mode, plain.size(), padded);
+    if (out.size() < n) throw std::runtime_error("Output buffer too small");
+    if (mode == CipherMode::Gcm) {
+        auto seal = [&](CryptoPP::GCM<CryptoPP::AES>::Encryption &enc) {
+            enc.EncryptAndAuthenticate(out.data(), out.data() + plain.size(), GCM_TAG_BYTES, iv, GCM_NONCE_BYTES,
+                                       (const byte*)aad.data(), aad.size(), plain.data(), plain.size());
+        };
+        if (g_use_crypto_ctx) {
+            seal(CryptoContext::local().gcm_encryptor(key));
+        } else {
+            CryptoPP::GCM<CryptoPP::AES>::Encryption enc;
+            enc.SetKeyWithIV(key, key.size(), iv, GCM_NONCE_BYTES);
+            seal(enc);
+        }
+        return n;
+    }
+    if (!padded && plain.size() % CryptoPP::AES::BLOCKSIZE) throw std::runtime_error("Unpadded CBC input must be whole blocks");
+    std::memcpy(out.data(), plain.data(), plain.size());
+    std::memset(out.data() + plain.size(), (int)(n - plain.size()), n - plain.size());
+    if (g_use_crypto_ctx) {
+        CryptoContext::local().encryptor(key, iv).ProcessData(out.data(), out.data(), n);
+    } else {
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption enc;
+        enc.SetKeyWithIV(key, key.size(), iv);
+        enc.ProcessData(out.data(), out.data(), n);
+    }
+    return n;
+}
+
+// Returns the plaintext length; out must hold the whole ciphertext (minus the tag for gcm)
+size_t aesOpenInto(CipherMode mode, const CryptoPP::SecByteBlock &key, const byte *iv, std::span<const byte> cipher,
+                   const string &aad, bool padded, std::span<byte> out) {
+    if (mode == CipherMode::Gcm) {
+        if (cipher.size() < GCM_TAG_BYTES) throw std::runtime_error("Short GCM ciphertext");
+        size_t n = cipher.size() - GCM_TAG_BYTES;
+        if (out.size() < n) throw std::runtime_error("Output buffer too small");
+        auto open = [&](CryptoPP::GCM<CryptoPP::AES>::Decryption &dec) {
+            return dec.DecryptAndVerify(out.data(), cipher.data() + n, GCM_TAG_BYTES, iv, GCM_NONCE_BYTES,
+                                        (const byte*)aad.data(), aad.size(), cipher.data(), n);
+        };
+        bool ok;
+        if (g_use_crypto_ctx) {
+            ok = open(CryptoContext::local().gcm_decryptor(key));
+        } else {
+            CryptoPP::GCM<CryptoPP::AES>::Decryption dec;
+            dec.SetKeyWithIV(key, key.size(), iv, GCM_NONCE_BYTES);
+            ok = open(dec);
+        }
+        if (!ok) throw std::runtime_error("GCM authentication failed");
+        return n;
+    }
+    size_t n = cipher.size();
+    if (n % CryptoPP::AES::BLOCKSIZE || (padded && n == 0)) throw std::runtime_error("Bad CBC ciphertext length");
+    if (out.size() < n) throw std::runtime_error("Output buffer too small");
+    if (g_use_crypto_ctx) {
+        CryptoContext::local().decryptor(key, iv).ProcessData(out.data(), cipher.data(), n);
+    } else {
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption dec;
+        dec.SetKeyWithIV(key, key.size(), iv);
+        dec.ProcessData(out.data(), cipher.data(), n);
+    }
+    if (!padded) return n;
+    size_t pad = out[n - 1];
+    if (pad == 0 || pad > CryptoPP::AES::BLOCKSIZE) throw std::runtime_error("Bad CBC padding");
+    for (size_t i = n - pad; i < n; ++i) {
+        if (out[i] != pad) throw std::runtime_error("Bad CBC padding");
+    }
+    return n - pad;
+}
+
+// Hex "iv:cipher" encoding, kept for debugging (--wire hex). The IV length tells the mode apart.
+string aesEncryptHex(const CryptoPP::SecByteBlock &key, const string &plain, const string &aad = "", bool padded = true) {
+    byte iv[CryptoPP::AES::BLOCKSIZE];
+    size_t iv_len = iv_bytes(g_cipher_mode);
+    random_block(iv, iv_len);
+    string cipher = aesSealRaw(g_cipher_mode, key, iv, plain, aad, padded);
+    string out(2 * iv_len + 1 + 2 * cipher.size(), ':');
+    hex_encode({iv, iv_len}, {out.data(), 2 * iv_len});
+    hex_encode({(const byte*)cipher.data(), cipher.size()}, {out.data() + 2 * iv_len + 1, 2 * cipher.size()});
+    return out;
+}
+
+string aesDecryptHex(const CryptoPP::SecByteBlock &key, const string &combined, const string &aad = "", bool padded = true) {
     auto pos = combined.find(':');
     if (pos == string::npos) throw std::runtime_error("Bad ciphertext format");
-    string ivhex = combined.substr(0, pos);
-    string chex  = combined.substr(pos + 1);
-    string iv = fromHex(ivhex);
-    string cipher = fromHex(chex);
+    std::span<const char> ivhex(combined.data(), pos);
+    std::span<const char> chex(combined.data() + pos + 1, combined.size() - pos - 1);
+    CipherMode mode;
+    if (ivhex.size() == 2 * CryptoPP::AES::BLOCKSIZE) mode = CipherMode::Cbc;
+    else if (ivhex.size() == 2 * GCM_NONCE_BYTES) mode = CipherMode::Gcm;
+    else throw std::runtime_error("Bad IV length");
+    byte iv[CryptoPP::AES::BLOCKSIZE];
+    string cipher(chex.size() / 2, '\0');
+    if (!hex_decode(ivhex, iv) || !hex_decode(chex, {(byte*)cipher.data(), cipher.size()}))
+        throw std::runtime_error("Bad hex encoding");
+    return aesOpenRaw(mode, key, iv, (const byte*)cipher.data(), cipher.size(), aad, padded);
+}
 
-    std::string recovered;
-    CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption dec;
-    dec.SetKeyWithIV(key, key.size(), (const byte*)iv.data());
-    CryptoPP::StringSource ss(cipher, true,
-        new CryptoPP::StreamTransformationFilter(dec, new CryptoPP::StringSink(recovered))
-    );
-    return recovered;
+// ---------- Binary wire frame ----------
+// [version:1][iv:16 (cbc) or nonce:12 (gcm)][cipher_len:4, big-endian][cipher (+tag for gcm)]
+constexpr byte WIRE_VERSION_CBC = 1;
+constexpr byte WIRE_VERSION_GCM = 2;
+
+size_t frame_header_bytes(CipherMode mode) {
+    return 1 + iv_bytes(mode) + 4;
+}
+
+string aesEncryptFrame(const CryptoPP::SecByteBlock &key, const string &plain, const string &aad = "", bool padded = true) {
+    CipherMode mode = g_cipher_mode;
+    byte iv[CryptoPP::AES::BLOCKSIZE];
+    size_t iv_len = iv_bytes(mode);
+    random_block(iv, iv_len);
+    string cipher = aesSealRaw(mode, key, iv, plain, aad, padded);
+    uint32_t len = (uint32_t)cipher.size();
+
+    string frame;
+    frame.reserve(frame_header_bytes(mode) + cipher.size());
+    frame.push_back((char)(mode == CipherMode::Gcm ? WIRE_VERSION_GCM : WIRE_VERSION_CBC));
+    frame.append((const char*)iv, iv_len);
+    frame.push_back((char)(len >> 24));
+    frame.push_back((char)(len >> 16));
+    frame.push_back((char)(len >> 8));
+    frame.push_back((char)len);
+    frame += cipher;
+    return frame;
+}
+
+struct FrameView {
+    CipherMode mode;
+    const byte *iv;
+    std::span<const byte> cipher;
+};
+
+FrameView parse_frame(std::span<const byte> frame) {
+    if (frame.empty()) throw std::runtime_error("Short frame");
+    const byte *p = frame.data();
+    CipherMode mode;
+    if (p[0] == WIRE_VERSION_CBC) mode = CipherMode::Cbc;
+    else if (p[0] == WIRE_VERSION_GCM) mode = CipherMode::Gcm;
+    else throw std::runtime_error("Unsupported frame version");
+    size_t header = frame_header_bytes(mode);
+    if (frame.size() < header) throw std::runtime_error("Short frame");
+    const byte *iv = p + 1;
+    const byte *lp = iv + iv_bytes(mode);
+    uint32_t len = ((uint32_t)lp[0] << 24) | ((uint32_t)lp[1] << 16) | ((uint32_t)lp[2] << 8) | (uint32_t)lp[3];
+    if (len != frame.size() - header) throw std::runtime_error("Bad frame length");
+    return {mode, iv, frame.subspan(header, len)};
+}
+
+string aesDecryptFrame(const CryptoPP::SecByteBlock &key, const string &frame, const string &aad = "", bool padded = true) {
+    FrameView f = parse_frame({(const byte*)frame.data(), frame.size()});
+    return aesOpenRaw(f.mode, key, f.iv, f.cipher.data(), f.cipher.size(), aad, padded);
+}
+
+// Frame straight into a caller buffer of at least frame_bytes(); returns the bytes written
+size_t frame_bytes(CipherMode mode, size_t plain_len, bool padded) {
+    return frame_header_bytes(mode) + sealed_bytes(mode, plain_len, padded);
+}
+
+size_t aesEncryptFrameInto(const CryptoPP::SecByteBlock &key, std::span<const byte> plain, const string &aad, bool padded, std::span<byte> out) {
+    CipherMode mode = g_cipher_mode;
+    size_t header = frame_header_bytes(mode);
+    if (out.size() < header) throw std::runtime_error("Output buffer too small");
+    byte *p = out.data();
+    p[0] = mode == CipherMode::Gcm ? WIRE_VERSION_GCM : WIRE_VERSION_CBC;
+    random_block(p + 1, iv_bytes(mode));
+    uint32_t len = (uint32_t)aesSealInto(mode, key, p + 1, plain, aad, padded, out.subspan(header));
+    byte *lp = p + 1 + iv_bytes(mode);
+    lp[0] = (byte)(len >> 24);
+    lp[1] = (byte)(len >> 16);
+    lp[2] = (byte)(len >> 8);
+    lp[3] = (byte)len;
+    return header + len;
+}
+
+// Returns the plaintext length; out must hold the frame's ciphertext
+size_t aesDecryptFrameInto(const CryptoPP::SecByteBlock &key, std::span<const byte> frame, const string &aad, bool padded, std::span<byte> out) {
+    FrameView f = parse_frame(frame);
+    return aesOpenInto(f.mode, key, f.iv, f.cipher, aad, padded, out);
+}
+
+// ---------- Chunk pool ----------
+// Small fixed pool that runs the chunks of one large message in parallel. The calling
+// thread works on its own job too, so a pool of N threads gives N+1-way parallelism.
+// Several callers can share the pool; each job is claimed chunk by chunk.
+class ChunkPool {
+public:
+    explicit ChunkPool(unsigned helpers) {
+        threads_.reserve(helpers);
+        for (unsigned i = 0; i < helpers; ++i) threads_.emplace_back([this] { run(); });
+    }
+
+    ~ChunkPool() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto &t : threads_) t.join();
+    }
+
+    ChunkPool(const ChunkPool &) = delete;
+    ChunkPool &operator=(const ChunkPool &) = delete;
+
+    unsigned helpers() const { return (unsigned)threads_.size(); }
+
+    // Runs fn(i) for i in [0, n); false if any call threw or returned false
+    template <typename F>
+    bool parallel_for(size_t n, F &&fn) {
+        Job job;
+        job.n = n;
+        job.ctx = &fn;
+        job.call = [](void *ctx, size_t i) { return (*static_cast<F*>(ctx))(i); };
+        if (n > 1 && !threads_.empty()) {
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                jobs_.push_back(&job);
+            }
+            work_cv_.notify_all();
+        }
+        work(job);
+        std::unique_lock<std::mutex> lk(mu_);
+        auto it = std::find(jobs_.begin(), jobs_.end(), &job);
+        if (it != jobs_.end()) jobs_.erase(it);
+        done_cv_.wait(lk, [&] { return job.active == 0 && job.done.load() == job.n; });
+        return !job.failed.load();
+    }
+
+private:
+    struct Job {
+        size_t n = 0;
+        std::atomic<size_t> next{0}, done{0};
+        std::atomic<bool> failed{false};
+        int active = 0;     // helper threads inside work(); guarded by mu_
+        void *ctx = nullptr;
+        bool (*call)(void*, size_t) = nullptr;
+    };
+
+    static void work(Job &job) {
+        for (size_t i; (i = job.next.fetch_add(1)) < job.n; job.done.fetch_add(1)) {
+            try {
+                if (!job.call(job.ctx, i)) job.failed = true;
+            } catch (const std::exception &) {
+                job.failed = true;
+            }
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(mu_);
+        while (true) {
+            work_cv_.wait(lk, [&] { return stop_ || !jobs_.empty(); });
+            if (stop_) return;
+            Job *job = jobs_.front();
+            if (job->next.load() >= job->n) {
+                jobs_.erase(jobs_.begin());   // fully claimed; its owner waits for done
+                continue;
+            }
+            ++job->active;
+            lk.unlock();
+            work(*job);
+            lk.lock();
+            if (--job->active == 0) done_cv_.notify_all();
+        }
+    }
+
+    std::mutex mu_;
+    std::condition_variable work_cv_, done_cv_;
+    std::vector<Job*> jobs_;     // a handful at most; a vector keeps its capacity, a deque reallocates blocks
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+};
+
+// ---------- Chunked frames for large bodies (--chunk-bytes N) ----------
+// [version:3][nonce prefix:8][chunk_bytes:4][chunk_count:4][plain_len:4], then per chunk
+// [cipher:chunk_len][tag:16]. Every chunk is sealed with GCM on its own nonce
+// (prefix || index), so chunks are sealed and verified in parallel. The chunk aad is the
+// message aad plus index and count, so reordered, spliced or truncated chunks fail.
+// Bodies at or below chunk_bytes, and g_chunk_bytes = 0, keep the single-pass frame.
+constexpr byte WIRE_VERSION_CHUNKED = 3;
+constexpr size_t CHUNK_NONCE_PREFIX_BYTES = 8;
+constexpr size_t CHUNKED_HEADER_BYTES = 1 + CHUNK_NONCE_PREFIX_BYTES + 12;
+
+size_t g_chunk_bytes = 0;
+std::unique_ptr<ChunkPool> g_chunk_pool;
+
+bool use_chunked(size_t plain_len) {
+    return g_chunk_bytes > 0 && plain_len > g_chunk_bytes;
+}
+
+size_t chunk_count(size_t plain_len, size_t chunk_bytes) {
+    return plain_len == 0 ? 1 : (plain_len + chunk_bytes - 1) / chunk_bytes;
+}
+
+size_t chunked_frame_bytes(size_t plain_len, size_t chunk_bytes) {
+    return CHUNKED_HEADER_BYTES + plain_len + chunk_count(plain_len, chunk_bytes) * GCM_TAG_BYTES;
+}
+
+void put_be32(byte *p, uint32_t v) {
+    p[0] = (byte)(v >> 24);
+    p[1] = (byte)(v >> 16);
+    p[2] = (byte)(v >> 8);
+    p[3] = (byte)v;
+}
+
+uint32_t get_be32(const byte *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Per-thread aad buffer, so chunk aads don't allocate once the capacity is there
+const string &chunk_aad(const string &aad, uint32_t index, uint32_t count) {
+    thread_local string buf;
+    buf.assign(aad);
+    byte tail[8];
+    put_be32(tail, index);
+    put_be32(tail + 4, count);
+    buf.append((const char*)tail, sizeof(tail));
+    return buf;
+}
+
+size_t aesEncryptChunkedInto(ChunkPool &pool, const CryptoPP::SecByteBlock &key, std::span<const byte> plain,
+                             const string &aad, size_t chunk_bytes, std::span<byte> out) {
+    size_t count = chunk_count(plain.size(), chunk_bytes);
+    size_t total = chunked_frame_bytes(plain.size(), chunk_bytes);
+    if (out.size() < total) throw std::runtime_error("Output buffer too small");
+    byte *p = out.data();
+    p[0] = WIRE_VERSION_CHUNKED;
+    random_block(p + 1, CHUNK_NONCE_PREFIX_BYTES);
+    put_be32(p + 1 + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)chunk_bytes);
+    put_be32(p + 5 + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)count);
+    put_be32(p + 9 + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)plain.size());
+    bool ok = pool.parallel_for(count, [&](size_t i) {
+        size_t at = i * chunk_bytes;
+        size_t len = std::min(chunk_bytes, plain.size() - at);
+        byte nonce[GCM_NONCE_BYTES];
+        std::memcpy(nonce, p + 1, CHUNK_NONCE_PREFIX_BYTES);
+        put_be32(nonce + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)i);
+        aesSealInto(CipherMode::Gcm, key, nonce, plain.subspan(at, len), chunk_aad(aad, (uint32_t)i, (uint32_t)count), false,
+                    out.subspan(CHUNKED_HEADER_BYTES + at + i * GCM_TAG_BYTES, len + GCM_TAG_BYTES));
+        return true;
+    });
+    if (!ok) throw std::runtime_error("Chunk encryption failed");
+    return total;
+}
+
+// Returns the plaintext length; out must hold plain_len bytes. Throws if any chunk fails to verify.
+size_t aesDecryptChunkedInto(ChunkPool &pool, const CryptoPP::SecByteBlock &key, std::span<const byte> frame,
+                             const string &aad, std::span<byte> out) {
+    if (frame.size() < CHUNKED_HEADER_BYTES || frame[0] != WIRE_VERSION_CHUNKED) throw std::runtime_error("Bad chunked frame");
+    const byte *p = frame.data();
+    size_t chunk_bytes = get_be32(p + 1 + CHUNK_NONCE_PREFIX_BYTES);
+    size_t count = get_be32(p + 5 + CHUNK_NONCE_PREFIX_BYTES);
+    size_t plain_len = get_be32(p + 9 + CHUNK_NONCE_PREFIX_BYTES);
+    if (chunk_bytes == 0 || count != chunk_count(plain_len, chunk_bytes) || frame.size() != chunked_frame_bytes(plain_len, chunk_bytes))
+        throw std::runtime_error("Bad chunked frame length");
+    if (out.size() < plain_len) throw std::runtime_error("Output buffer too small");
+    bool ok = pool.parallel_for(count, [&](size_t i) {
+        size_t at = i * chunk_bytes;
+        size_t len = std::min(chunk_bytes, plain_len - at);
+        byte nonce[GCM_NONCE_BYTES];
+        std::memcpy(nonce, p + 1, CHUNK_NONCE_PREFIX_BYTES);
+        put_be32(nonce + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)i);
+        aesOpenInto(CipherMode::Gcm, key, nonce, frame.subspan(CHUNKED_HEADER_BYTES + at + i * GCM_TAG_BYTES, len + GCM_TAG_BYTES),
+                    chunk_aad(aad, (uint32_t)i, (uint32_t)count), false, out.subspan(at, len));
+        return true;
+    });
+    if (!ok) throw std::runtime_error("GCM authentication failed");
+    return plain_len;
+}
+
+// ---------- Protocol message encoding (--wire binary|hex) ----------
+enum class WireFormat { Binary, Hex };
+WireFormat g_wire_format = WireFormat::Binary;
+
+const char* wire_format_name(WireFormat w) {
+    return w == WireFormat::Hex ? "hex" : "binary";
+}
+
+// aad is the node id on every hop; only gcm uses it
+string aesEncryptMsg(const CryptoPP::SecByteBlock &key, const string &plain, const string &aad, bool padded = true) {
+    return g_wire_format == WireFormat::Hex ? aesEncryptHex(key, plain, aad, padded) : aesEncryptFrame(key, plain, aad, padded);
+}
+
+string aesDecryptMsg(const CryptoPP::SecByteBlock &key, const string &msg, const string &aad, bool padded = true) {
+    return g_wire_format == WireFormat::Hex ? aesDecryptHex(key, msg, aad, padded) : aesDecryptFrame(key, msg, aad, padded);
+}
+
+// Arena/span path: binary frames only; hex stays on the string helpers
+bool span_wire() {
+    return g_use_arena && g_wire_format == WireFormat::Binary;
+}
+
+// Seals into out, reusing its capacity
+void aesEncryptMsgInto(const CryptoPP::SecByteBlock &key, std::span<const byte> plain, const string &aad, bool padded, string &out) {
+    if (!span_wire()) {
+        out = aesEncryptMsg(key, string((const char*)plain.data(), plain.size()), aad, padded);
+        return;
+    }
+    out.resize(frame_bytes(g_cipher_mode, plain.size(), padded));
+    out.resize(aesEncryptFrameInto(key, plain, aad, padded, {(byte*)out.data(), out.size()}));
+}
+
+// Returns the plaintext length
+size_t aesDecryptMsgInto(const CryptoPP::SecByteBlock &key, const string &msg, const string &aad, bool padded, std::span<byte> out) {
+    if (span_wire()) return aesDecryptFrameInto(key, {(const byte*)msg.data(), msg.size()}, aad, padded, out);
+    string plain = aesDecryptMsg(key, msg, aad, padded);
+    if (plain.size() > out.size()) throw std::runtime_error("Output buffer too small");
+    std::memcpy(out.data(), plain.data(), plain.size());
+    return plain.size();
 }
 
 // ---------- Random token generator (hex string) ----------
 string genTokenHex(size_t bytes = 16) {
-    CryptoPP::AutoSeededRandomPool rng;
     std::string raw(bytes, '\0');
-    rng.GenerateBlock((byte*)raw.data(), raw.size());
+    random_block((byte*)raw.data(), raw.size());
     return toHex(raw);
 }
 
@@ -104,35 +1141,683 @@ CryptoPP::SecByteBlock KEY_TA_NODE;
 CryptoPP::SecByteBlock KEY_NODE_MW;
 CryptoPP::SecByteBlock KEY_TA_MW;
 
-// ---------- TA issues per-request tokens (stateless helper) ----------
-struct IssuedTokens {
-    string token_plain;
-    string enc_for_node;
-    string enc_for_mw;
+string node_id_string(uint32_t node_num) {
+    return NODE_ID_BASE + std::to_string(node_num);
+}
+
+long long unix_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Clock tokens are stamped and checked against: the wall clock, or the des virtual clock
+long long g_virtual_now_ms = -1;
+
+long long protocol_now_ms() {
+    return g_virtual_now_ms >= 0 ? g_virtual_now_ms : unix_ms();
+}
+
+// ---------- Per-node key hierarchy (HKDF-SHA256) ----------
+// Every node has its own TA<->Node and Node<->MW keys, derived from the current epoch's
+// master secrets:  key = HKDF-SHA256(master, salt, info = label | node_num:4 BE).
+// The TA<->MW key stays a single key shared by the two services.
+// shared: every node uses the master keys directly (the old behaviour)
+// precomputed: all node keys derived at startup into a direct-indexed directory
+// lazy: directory entries derived on first lookup
+enum class KeyMode { Shared, Precomputed, Lazy };
+KeyMode g_key_mode = KeyMode::Precomputed;
+
+const char* key_mode_name(KeyMode k) {
+    switch (k) {
+        case KeyMode::Shared: return "shared";
+        case KeyMode::Lazy: return "lazy";
+        default: return "precomputed";
+    }
+}
+
+constexpr size_t NODE_KEY_BYTES = 16;
+const string NODE_KEY_SALT = "tps-node-keys-v1";
+
+void derive_node_key(const CryptoPP::SecByteBlock &master, const char *label, uint32_t node_num, byte *out) {
+    byte info[16];
+    size_t n = std::strlen(label);
+    std::memcpy(info, label, n);
+    info[n] = (byte)(node_num >> 24);
+    info[n + 1] = (byte)(node_num >> 16);
+    info[n + 2] = (byte)(node_num >> 8);
+    info[n + 3] = (byte)node_num;
+    CryptoPP::HKDF<CryptoPP::SHA256>().DeriveKey(out, NODE_KEY_BYTES, master, master.size(),
+                                                 (const byte*)NODE_KEY_SALT.data(), NODE_KEY_SALT.size(), info, n + 4);
+}
+
+// Direct-indexed by node number: 32 bytes per node, plus a state byte per node in lazy mode.
+// Node numbers past the directory are derived on every lookup.
+class KeyDirectory {
+public:
+    enum class Key { TaNode, NodeMw };
+
+    // Precomputed mode splits the derivation across `threads`
+    void build(const CryptoPP::SecByteBlock &ta_node_master, const CryptoPP::SecByteBlock &node_mw_master,
+               uint32_t nodes, bool precompute, unsigned threads) {
+        ta_node_master_ = ta_node_master;
+        node_mw_master_ = node_mw_master;
+        nodes_ = nodes;
+        entries_ = std::make_unique<Entry[]>(nodes);
+        state_.reset();
+        if (!precompute) {
+            state_ = std::make_unique<std::atomic<uint8_t>[]>(nodes);
+            for (uint32_t i = 0; i < nodes; ++i) state_[i].store(EMPTY, std::memory_order_relaxed);
+            return;
+        }
+        threads = std::max(1u, std::min(threads, nodes));
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < threads; ++t) {
+            pool.emplace_back([this, t, threads] {
+                for (uint32_t i = t; i < nodes_; i += threads) derive_entry(i, entries_[i]);
+            });
+        }
+        for (auto &th : pool) th.join();
+    }
+
+    CryptoPP::SecByteBlock lookup(Key which, uint32_t node_num) const {
+        CryptoPP::SecByteBlock key(NODE_KEY_BYTES);
+        lookup_into(which, node_num, key.begin());
+        return key;
+    }
+
+    // Writes NODE_KEY_BYTES into out
+    void lookup_into(Key which, uint32_t node_num, byte *out) const {
+        if (node_num >= nodes_) {
+            Entry e;
+            derive_entry(node_num, e);
+            return copy_key(which, e, out);
+        }
+        if (!state_) return copy_key(which, entries_[node_num], out);
+
+        std::atomic<uint8_t> &st = state_[node_num];
+        if (st.load(std::memory_order_acquire) != READY) {
+            uint8_t expected = EMPTY;
+            if (!st.compare_exchange_strong(expected, BUSY, std::memory_order_acq_rel)) {
+                if (expected != READY) {
+                    // Another thread is filling this entry; derive a private copy instead of waiting
+                    Entry e;
+                    derive_entry(node_num, e);
+                    return copy_key(which, e, out);
+                }
+            } else {
+                derive_entry(node_num, entries_[node_num]);
+                st.store(READY, std::memory_order_release);
+            }
+        }
+        copy_key(which, entries_[node_num], out);
+    }
+
+    size_t size() const { return nodes_; }
+    size_t memory_bytes() const { return nodes_ * (sizeof(Entry) + (state_ ? 1 : 0)); }
+
+private:
+    static constexpr uint8_t EMPTY = 0, BUSY = 1, READY = 2;
+
+    struct Entry {
+        byte ta_node[NODE_KEY_BYTES];
+        byte node_mw[NODE_KEY_BYTES];
+    };
+
+    void derive_entry(uint32_t node_num, Entry &e) const {
+        derive_node_key(ta_node_master_, "ta-node", node_num, e.ta_node);
+        derive_node_key(node_mw_master_, "node-mw", node_num, e.node_mw);
+    }
+
+    static void copy_key(Key which, const Entry &e, byte *out) {
+        std::memcpy(out, which == Key::TaNode ? e.ta_node : e.node_mw, NODE_KEY_BYTES);
+    }
+
+    CryptoPP::SecByteBlock ta_node_master_, node_mw_master_;
+    uint32_t nodes_ = 0;
+    std::unique_ptr<Entry[]> entries_;
+    std::unique_ptr<std::atomic<uint8_t>[]> state_;   // lazy mode only
+};
+
+// One generation of keys. Rotation replaces all three masters and rebuilds the node directory.
+struct KeySet {
+    uint32_t epoch = 0;
+    CryptoPP::SecByteBlock ta_node, node_mw, ta_mw;    // masters; ta_mw is used as-is
+    KeyDirectory directory;
+
+    CryptoPP::SecByteBlock node_key(KeyDirectory::Key which, uint32_t node_num) const {
+        if (g_key_mode == KeyMode::Shared) return which == KeyDirectory::Key::TaNode ? ta_node : node_mw;
+        return directory.lookup(which, node_num);
+    }
+
+    // Into a caller-owned key (sized NODE_KEY_BYTES), so the hot path doesn't allocate one per message
+    void node_key_into(KeyDirectory::Key which, uint32_t node_num, CryptoPP::SecByteBlock &out) const {
+        if (g_key_mode == KeyMode::Shared) {
+            const CryptoPP::SecByteBlock &master = which == KeyDirectory::Key::TaNode ? ta_node : node_mw;
+            std::memcpy(out.begin(), master.begin(), NODE_KEY_BYTES);
+            return;
+        }
+        directory.lookup_into(which, node_num, out.begin());
+    }
+};
+
+// Per-thread scratch keys for node_key_into; slot 1 is for a second key held at the same time
+CryptoPP::SecByteBlock &scratch_key(int slot = 0) {
+    thread_local CryptoPP::SecByteBlock keys[2] = {CryptoPP::SecByteBlock(NODE_KEY_BYTES), CryptoPP::SecByteBlock(NODE_KEY_BYTES)};
+    return keys[slot];
+}
+
+std::unique_ptr<KeySet> build_key_set(const CryptoPP::SecByteBlock &ta_node, const CryptoPP::SecByteBlock &node_mw,
+                                      const CryptoPP::SecByteBlock &ta_mw, uint32_t nodes, unsigned threads) {
+    auto ks = std::make_unique<KeySet>();
+    ks->ta_node = ta_node;
+    ks->node_mw = node_mw;
+    ks->ta_mw = ta_mw;
+    if (g_key_mode != KeyMode::Shared) ks->directory.build(ta_node, node_mw, nodes, g_key_mode == KeyMode::Precomputed, threads);
+    return ks;
+}
+
+// ---------- Key epochs (live rotation) ----------
+// Key sets live in a ring of SLOTS generations indexed by epoch. Messages carry the epoch
+// they were sealed under; the middleware accepts the current epoch and the two before it.
+// Readers pin the epoch they started under with one store to a per-thread slot: no lock on
+// the hot path. The rotation thread reuses a ring slot only after every pinned reader has
+// moved past the epochs that could still reach it (epoch-based reclamation, RCU-style).
+constexpr size_t KEY_EPOCH_BYTES = 4;   // cleartext epoch header on every keyed message
+
+// One per reader thread, on its own cache line
+struct alignas(64) KeyReaderSlot {
+    std::atomic<uint32_t> pinned{0};
+    std::atomic<bool> used{false};
+};
+
+class KeyRing {
+    using ReaderSlot = KeyReaderSlot;
+
+public:
+    static constexpr uint32_t SLOTS = 4;
+    static constexpr uint32_t IDLE = 0;     // epochs start at 1
+
+    // Before any reader exists
+    void reset(std::unique_ptr<KeySet> ks) {
+        for (auto &s : slots_) s.reset();
+        ks->epoch = 1;
+        slots_[1] = std::move(ks);
+        epoch_.store(1, std::memory_order_release);
+    }
+
+    // Single writer at a time; blocks only the rotation thread, never readers
+    uint32_t install(std::unique_ptr<KeySet> ks) {
+        std::lock_guard<std::mutex> lg(install_mutex_);
+        uint32_t cur = epoch_.load(std::memory_order_relaxed);
+        uint32_t next = cur + 1;
+        // A reader pinned at p may touch epochs down to p - (SLOTS - 2); wait until that is above next - SLOTS
+        for (auto &r : readers_) {
+            uint32_t p;
+            while ((p = r.pinned.load(std::memory_order_seq_cst)) != IDLE && p < cur) std::this_thread::yield();
+        }
+        ks->epoch = next;
+        slots_[next % SLOTS] = std::move(ks);
+        epoch_.store(next, std::memory_order_seq_cst);
+        return next;
+    }
+
+    uint32_t epoch() const { return epoch_.load(std::memory_order_acquire); }
+
+    bool accepts(uint32_t e) const {
+        uint32_t cur = epoch();
+        return e != IDLE && e <= cur && e + (SLOTS - 2) >= cur;
+    }
+
+    // Pins the current epoch for the lifetime of the guard. Guards nest; the outer one wins.
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const KeyRing &ring) : ring_(ring), slot_(reader_slot()) {
+            outer_ = slot_.pinned.load(std::memory_order_relaxed) == IDLE;
+            if (!outer_) return;
+            uint32_t e = ring.epoch_.load(std::memory_order_seq_cst);
+            while (true) {
+                slot_.pinned.store(e, std::memory_order_seq_cst);
+                uint32_t again = ring.epoch_.load(std::memory_order_seq_cst);
+                if (again == e) break;
+                e = again;
+            }
+        }
+        ~ReadGuard() {
+            if (outer_) slot_.pinned.store(IDLE, std::memory_order_release);
+        }
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+
+        uint32_t epoch() const { return slot_.pinned.load(std::memory_order_relaxed); }
+        const KeySet &current() const { return *ring_.slots_[epoch() % SLOTS]; }
+
+        // nullptr once the epoch has left the accepted window
+        const KeySet *at(uint32_t e) const {
+            uint32_t pin = epoch();
+            if (e == IDLE || e + (SLOTS - 2) < pin) return nullptr;
+            if (e > pin && e > ring_.epoch_.load(std::memory_order_acquire)) return nullptr;
+            return ring_.slots_[e % SLOTS].get();
+        }
+
+    private:
+        const KeyRing &ring_;
+        ReaderSlot &slot_;
+        bool outer_;
+    };
+
+private:
+    static constexpr size_t MAX_READERS = 512;
+
+    // Claimed on a thread's first read, released when the thread exits
+    static ReaderSlot &reader_slot() {
+        struct Handle {
+            ReaderSlot *slot = nullptr;
+            Handle() {
+                for (auto &r : readers_) {
+                    bool expected = false;
+                    if (r.used.compare_exchange_strong(expected, true)) { slot = &r; return; }
+                }
+                throw std::runtime_error("Too many key readers");
+            }
+            ~Handle() {
+                slot->pinned.store(IDLE, std::memory_order_release);
+                slot->used.store(false, std::memory_order_release);
+            }
+        };
+        thread_local Handle h;
+        return *h.slot;
+    }
+
+    static inline ReaderSlot readers_[MAX_READERS];
+    std::unique_ptr<KeySet> slots_[SLOTS];
+    std::atomic<uint32_t> epoch_{IDLE};
+    std::mutex install_mutex_;
 };
 
-IssuedTokens TA_issue_tokens_for_node(const string &node_id) {
-    string token = genTokenHex(16);
-    string payload_for_node = "NODE_ID:" + node_id + ";TOKEN:" + token;
-    string payload_for_mw   = "MW_EXPECTS_NODE:" + node_id + ";TOKEN:" + token;
-    string enc_node = aesEncryptHex(KEY_TA_NODE, payload_for_node);
-    string enc_mw   = aesEncryptHex(KEY_TA_MW, payload_for_mw);
-    return { token, enc_node, enc_mw };
+KeyRing g_keys;
+uint32_t g_key_directory_nodes = 0;     // directory size for rotated key sets
+std::atomic<int> g_key_rotations{0};
+std::atomic<long long> g_stale_epoch_rejects{0};   // messages whose epoch had left the window
+
+// New random masters, directory rebuilt off the hot path, then published as the next epoch
+uint32_t rotate_keys() {
+    CryptoPP::SecByteBlock ta_node(16), node_mw(16), ta_mw(16);
+    random_block(ta_node, ta_node.size());
+    random_block(node_mw, node_mw.size());
+    random_block(ta_mw, ta_mw.size());
+    uint32_t e = g_keys.install(build_key_set(ta_node, node_mw, ta_mw, g_key_directory_nodes, std::thread::hardware_concurrency()));
+    g_key_rotations.fetch_add(1, std::memory_order_relaxed);
+    return e;
+}
+
+// Rotates on a wall-clock schedule in a background thread (threads and coro engines, --bench key-rotation)
+class KeyRotator {
+public:
+    struct Window { std::chrono::steady_clock::time_point start, end; };
+
+    explicit KeyRotator(int every_ms) {
+        if (every_ms <= 0) return;
+        thread_ = std::thread([this, every_ms] {
+            std::unique_lock<std::mutex> lk(mutex_);
+            while (!cv_.wait_for(lk, std::chrono::milliseconds(every_ms), [this] { return stop_; })) {
+                lk.unlock();
+                auto t0 = std::chrono::steady_clock::now();
+                rotate_keys();
+                auto t1 = std::chrono::steady_clock::now();
+                lk.lock();
+                windows_.push_back({t0, t1});
+            }
+        });
+    }
+    ~KeyRotator() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lg(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // Only read after stop()
+    const std::vector<Window> &windows() const { return windows_; }
+
+private:
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::vector<Window> windows_;
+};
+
+// ---------- Token record (fixed layout) ----------
+// Exactly two AES blocks, big-endian fields:
+// [node_id:4][token:16][issued_ms:8][ttl_ms:4]
+constexpr size_t TOKEN_BYTES = 16;
+constexpr size_t TOKEN_RECORD_BYTES = 32;
+constexpr uint32_t TOKEN_TTL_MS = 60000;
+uint32_t g_token_ttl_ms = TOKEN_TTL_MS;      // --token-ttl-ms
+int g_token_max_uses = 0;                    // --token-max-uses, 0 = until expiry
+
+struct TokenRecord {
+    uint32_t node_id = 0;
+    byte token[TOKEN_BYTES] = {};
+    uint64_t issued_ms = 0;
+    uint32_t ttl_ms = 0;
+
+    void pack(byte *out) const {
+        for (int i = 0; i < 4; ++i) out[i] = (byte)(node_id >> (24 - 8*i));
+        std::memcpy(out + 4, token, TOKEN_BYTES);
+        for (int i = 0; i < 8; ++i) out[20 + i] = (byte)(issued_ms >> (56 - 8*i));
+        for (int i = 0; i < 4; ++i) out[28 + i] = (byte)(ttl_ms >> (24 - 8*i));
+    }
+
+    static TokenRecord unpack(const byte *in) {
+        TokenRecord r;
+        for (int i = 0; i < 4; ++i) r.node_id = (r.node_id << 8) | in[i];
+        std::memcpy(r.token, in + 4, TOKEN_BYTES);
+        for (int i = 0; i < 8; ++i) r.issued_ms = (r.issued_ms << 8) | in[20 + i];
+        for (int i = 0; i < 4; ++i) r.ttl_ms = (r.ttl_ms << 8) | in[28 + i];
+        return r;
+    }
+
+    string packed() const {
+        string out(TOKEN_RECORD_BYTES, '\0');
+        pack((byte*)out.data());
+        return out;
+    }
+
+    bool expired(long long now_ms) const {
+        return now_ms > (long long)(issued_ms + ttl_ms);
+    }
+};
+
+// Constant-time over the whole record, so a mismatch leaks nothing about where it is
+bool token_records_equal(const byte *a, const byte *b) {
+    return CryptoPP::VerifyBufsEqual(a, b, TOKEN_RECORD_BYTES);
+}
+
+// ---------- Middleware expected-token table ----------
+// Filled by the TA at issuance so the middleware's hot path is one hash lookup plus
+// one constant-time compare, instead of decrypting a TA->MW message per request.
+// Sharded by node id; each shard is an open-addressed array behind a shared_mutex,
+// since lookups vastly outnumber inserts. Each entry counts its uses so a reused
+// token can be capped at g_token_max_uses.
+class ExpectedTokenTable {
+public:
+    static constexpr size_t SHARDS = 64;
+
+    void reserve(size_t total) {
+        for (auto &sh : shards_) {
+            std::unique_lock<std::shared_mutex> lk(sh.mu);
+            grow(sh, total / SHARDS + 1);
+        }
+    }
+
+    void put(const TokenRecord &rec) {
+        uint32_t h = mix(rec.node_id);
+        Shard &sh = shards_[h >> SHARD_SHIFT];
+        std::unique_lock<std::shared_mutex> lk(sh.mu);
+        if ((sh.count + 1) * 4 > sh.slots.size() * 3) grow(sh, sh.count + 1);
+        size_t mask = sh.slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot &s = sh.slots[i];
+            if (s.key_plus1 == 0 || s.key_plus1 == rec.node_id + 1) {
+                if (s.key_plus1 == 0) ++sh.count;
+                s.key_plus1 = rec.node_id + 1;
+                s.uses = 0;
+                rec.pack(s.record);
+                return;
+            }
+        }
+    }
+
+    // presented is a packed TokenRecord as received from the node
+    bool validate(const byte *presented, long long now_ms) {
+        uint32_t node_id = TokenRecord::unpack(presented).node_id;
+        uint32_t h = mix(node_id);
+        Shard &sh = shards_[h >> SHARD_SHIFT];
+        std::shared_lock<std::shared_mutex> lk(sh.mu);
+        if (sh.slots.empty()) return false;
+        size_t mask = sh.slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot &s = sh.slots[i];
+            if (s.key_plus1 == 0) return false;
+            if (s.key_plus1 == node_id + 1) {
+                if (!token_records_equal(presented, s.record) || TokenRecord::unpack(s.record).expired(now_ms)) return false;
+                // Readers share the lock, so the use count is bumped atomically
+                uint32_t uses = std::atomic_ref<uint32_t>(s.uses).fetch_add(1, std::memory_order_relaxed) + 1;
+                return g_token_max_uses <= 0 || uses <= (uint32_t)g_token_max_uses;
+            }
+        }
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (auto &sh : shards_) {
+            std::shared_lock<std::shared_mutex> lk(sh.mu);
+            n += sh.count;
+        }
+        return n;
+    }
+
+    size_t memory_bytes() const {
+        size_t n = sizeof(*this);
+        for (auto &sh : shards_) {
+            std::shared_lock<std::shared_mutex> lk(sh.mu);
+            n += sh.slots.capacity() * sizeof(Slot);
+        }
+        return n;
+    }
+
+private:
+    static constexpr int SHARD_SHIFT = 26;     // top 6 bits of the hash pick one of 64 shards
+
+    struct Slot {
+        uint32_t key_plus1 = 0;                // 0 = empty
+        uint32_t uses = 0;
+        byte record[TOKEN_RECORD_BYTES];
+    };
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mu;
+        std::vector<Slot> slots;               // power-of-two size, linear probing
+        size_t count = 0;
+    };
+
+    static uint32_t mix(uint32_t k) {
+        k ^= k >> 16; k *= 0x85ebca6bu;
+        k ^= k >> 13; k *= 0xc2b2ae35u;
+        return k ^ (k >> 16);
+    }
+
+    // Caller holds the shard's unique lock
+    static void grow(Shard &sh, size_t min_entries) {
+        size_t cap = 16;
+        while (cap * 3 < min_entries * 4) cap *= 2;
+        if (cap <= sh.slots.size()) return;
+        std::vector<Slot> old;
+        old.swap(sh.slots);
+        sh.slots.assign(cap, Slot{});
+        size_t mask = cap - 1;
+        for (const Slot &s : old) {
+            if (s.key_plus1 == 0) continue;
+            size_t i = mix(s.key_plus1 - 1) & mask;
+            while (sh.slots[i].key_plus1 != 0) i = (i + 1) & mask;
+            sh.slots[i] = s;
+        }
+    }
+
+    Shard shards_[SHARDS];
+};
+
+ExpectedTokenTable g_mw_tokens;
+
+// How the middleware learns the expected token (--mw-validation table|decrypt|mac)
+enum class MwValidation { Table, Decrypt, Mac };
+MwValidation g_mw_validation = MwValidation::Table;
+
+const char* mw_validation_name(MwValidation v) {
+    switch (v) {
+        case MwValidation::Decrypt: return "decrypt";
+        case MwValidation::Mac: return "mac";
+        default: return "table";
+    }
+}
+
+// ---------- Stateless MAC tokens (--mw-validation mac) ----------
+// The token field becomes [nonce:8][cmac:8], where the CMAC-AES under the TA<->MW key covers the
+// whole packed record with the mac bytes zeroed (node id, nonce, issue time, ttl). The
+// middleware recomputes it: no TA->MW message and nothing stored. A 64-bit tag is enough
+// for tokens that expire in TOKEN_TTL_MS and can only be guessed online.
+// The first 4 nonce bytes are the key epoch of the tag, so it survives rotations.
+constexpr size_t MAC_NONCE_BYTES = 8;
+constexpr size_t MAC_TAG_BYTES = TOKEN_BYTES - MAC_NONCE_BYTES;
+constexpr size_t MAC_TAG_OFFSET = 4 + MAC_NONCE_BYTES;     // within the packed record
+
+void compute_token_mac(const CryptoPP::SecByteBlock &key, const byte *packed, byte *tag) {
+    byte buf[TOKEN_RECORD_BYTES];
+    std::memcpy(buf, packed, TOKEN_RECORD_BYTES);
+    std::memset(buf + MAC_TAG_OFFSET, 0, MAC_TAG_BYTES);
+    if (g_use_crypto_ctx) {
+        CryptoContext::local().cmac(key).CalculateTruncatedDigest(tag, MAC_TAG_BYTES, buf, sizeof(buf));
+    } else {
+        CryptoPP::CMAC<CryptoPP::AES> mac(key, key.size());
+        mac.CalculateTruncatedDigest(tag, MAC_TAG_BYTES, buf, sizeof(buf));
+    }
+}
+
+// TA side: fills token with epoch || nonce || tag
+void seal_mac_token(TokenRecord &rec, const KeySet &keys) {
+    rec.token[0] = (byte)(keys.epoch >> 24);
+    rec.token[1] = (byte)(keys.epoch >> 16);
+    rec.token[2] = (byte)(keys.epoch >> 8);
+    rec.token[3] = (byte)keys.epoch;
+    random_block(rec.token + KEY_EPOCH_BYTES, MAC_NONCE_BYTES - KEY_EPOCH_BYTES);
+    byte packed[TOKEN_RECORD_BYTES];
+    rec.pack(packed);
+    compute_token_mac(keys.ta_mw, packed, rec.token + MAC_NONCE_BYTES);
+}
+
+// Middleware side: recompute under the token's epoch and compare in constant time, then check expiry
+bool verify_mac_token(const byte *presented, long long now_ms, const KeyRing::ReadGuard &keys) {
+    const byte *e = presented + 4;
+    const KeySet *ks = keys.at(((uint32_t)e[0] << 24) | ((uint32_t)e[1] << 16) | ((uint32_t)e[2] << 8) | (uint32_t)e[3]);
+    if (!ks) {
+        g_stale_epoch_rejects.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    byte tag[MAC_TAG_BYTES];
+    compute_token_mac(ks->ta_mw, presented, tag);
+    if (!CryptoPP::VerifyBufsEqual(tag, presented + MAC_TAG_OFFSET, MAC_TAG_BYTES)) return false;
+    return !TokenRecord::unpack(presented).expired(now_ms);
+}
+
+// ---------- TA issues per-request tokens ----------
+struct IssuedTokens {
+    TokenRecord token;
+    uint32_t key_epoch = 0;     // epoch both messages were sealed under
+    string enc_for_node;
+    string enc_for_mw;      // only sent with --mw-validation decrypt
+};
+
+// Fills issued in place so a reused IssuedTokens keeps its message buffers
+void TA_issue_tokens_into(uint32_t node_num, IssuedTokens &issued) {
+    KeyRing::ReadGuard keys(g_keys);
+    const KeySet &ks = keys.current();
+    issued.key_epoch = ks.epoch;
+    issued.token = TokenRecord{};
+    issued.token.node_id = node_num;
+    issued.token.issued_ms = (uint64_t)protocol_now_ms();
+    issued.token.ttl_ms = g_token_ttl_ms;
+    if (g_mw_validation == MwValidation::Mac) seal_mac_token(issued.token, ks);
+    else random_block(issued.token.token, TOKEN_BYTES);
+    byte record[TOKEN_RECORD_BYTES];
+    issued.token.pack(record);
+    string node_id = node_id_string(node_num);
+    CryptoPP::SecByteBlock &key = scratch_key();
+    ks.node_key_into(KeyDirectory::Key::TaNode, node_num, key);
+    aesEncryptMsgInto(key, record, node_id, false, issued.enc_for_node);
+    // With the table the TA enrolls the token directly; no per-request TA->MW message
+    // With mac the middleware recomputes the token itself
+    if (g_mw_validation == MwValidation::Table) g_mw_tokens.put(issued.token);
+    if (g_mw_validation == MwValidation::Decrypt) aesEncryptMsgInto(ks.ta_mw, record, node_id, false, issued.enc_for_mw);
+    else issued.enc_for_mw.clear();
+}
+
+IssuedTokens TA_issue_tokens_for_node(uint32_t node_num) {
+    IssuedTokens issued;
+    TA_issue_tokens_into(node_num, issued);
+    return issued;
 }
 
 // ---------- Config ----------
+enum class Engine { Threads, Des, Coro, Pipeline };
+enum class Scheduler { Counter, Steal };
+enum class ArrivalProcess { Poisson, Constant };
+enum class StatsMode { Exact, Stream };
+
 struct Config {
     int nodes = 100;                  // Number of simulated nodes
     int workers = 2;                  // Simulate weak CPU: only 2 concurrent threads
     double tamper_percent = 0.0;      // No tampering unless you want to test it
     int payload_bytes = 500;          // Typical small IoT/LAN message
+    int payload_bytes_max = 0;        // > payload_bytes: per-node payloads spread log-uniformly up to this
     int node_start_jitter_ms = 50;    // Small jitter in node start times
     int net_delay_ta_node_min = 5, net_delay_ta_node_max = 20;    // LAN: low network delay (ms)
     int net_delay_node_mw_min = 5, net_delay_node_mw_max = 20;    // LAN: low network delay (ms)
     int db_delay_min = 10, db_delay_max = 30;                     // Simulate slow DB or processing (ms)
     double fail_percent = 0.0;         // 2% simulated drop/failure rate
+    long long seed = -1;              // keys every node's random draws; -1 = pick one (printed, so the run can be repeated)
     string out_file = "realistic_perf.csv";
+    string phase_csv = "node_phases.csv";   // per-node time by protocol phase
+    StatsMode stats = StatsMode::Exact;     // exact: keep every node's metrics; stream: per-thread sketches only
+    double sketch_accuracy = 0.01;    // stream: relative error of every reported quantile
+    Engine engine = Engine::Threads;  // threads: real sleeps; des: virtual clock + event queue; coro: coroutines on a timer wheel; pipeline: TA/node/MW stages
+    Scheduler scheduler = Scheduler::Steal;   // threads engine: per-worker deques with stealing, or one shared counter
+    int inflight = 0;                 // coro/pipeline: max nodes in flight at once (0 = engine default)
+    int ta_workers = 0;               // pipeline: TA stage threads (0 = --workers)
+    int mw_workers = 0;               // pipeline: middleware stage threads (0 = --workers)
+    double arrival_rate = 0.0;        // open loop: node arrivals per second (0 = closed loop)
+    ArrivalProcess arrival = ArrivalProcess::Poisson;   // poisson or constant gaps between arrivals
+    int requests_per_node = 1;        // requests each node sends in its session
+    int token_ttl_ms = (int)TOKEN_TTL_MS;   // token lifetime; nodes reuse a token until it expires
+    int token_max_uses = 0;           // cap on requests per token (0 = until expiry; enforced by the table)
+    CipherMode cipher = CipherMode::Cbc;    // cbc, or gcm with the node id as associated data
+    MwValidation mw_validation = MwValidation::Table;   // table: TA-filled lookup; decrypt: TA->MW message per request; mac: stateless CMAC token
+    WireFormat wire = WireFormat::Binary;   // binary frames on every hop; hex is the debug encoding
+    bool crypto_ctx = true;           // per-thread RNG + pre-keyed ciphers (false = per-call setup)
+    bool force_scalar = false;        // ignore AES-NI/PCLMUL/SIMD and run every kernel's portable path
+    bool arena = true;                // per-thread arena + span crypto on the request path (false = strings per step)
+    int stream_frame_bytes = 0;       // stream bodies larger than this frame by frame (0 = whole body in memory)
+    int stream_window = 4;            // frames in flight between node and middleware before the node stalls
+    int chunk_bytes = 0;              // split bodies larger than this into parallel GCM chunks (0 = single pass)
+    int crypto_threads = 0;           // threads per chunked message, caller included (0 = hardware threads)
+    KeyMode keys = KeyMode::Precomputed;    // per-node HKDF keys: precomputed directory, lazy, or one shared key
+    int rotate_every_ms = 0;          // live key rotation interval (0 = never)
+    string bench;                     // run the named microbenchmark instead of a simulation
+    int bench_iters = 20000;
+    int bench_reps = 5;               // minimum repetitions per cell (--bench primitives)
+    string bench_out = "bench_primitives.json";
 };
+
+const char* engine_name(Engine e) {
+    switch (e) {
+        case Engine::Des: return "des";
+        case Engine::Coro: return "coro";
+        case Engine::Pipeline: return "pipeline";
+        default: return "threads";
+    }
+}
+
+const char* scheduler_name(Scheduler s) {
+    return s == Scheduler::Counter ? "counter" : "steal";
+}
+
+const char* arrival_process_name(ArrivalProcess a) {
+    return a == ArrivalProcess::Constant ? "constant" : "poisson";
+}
+
 bool parse_args(int argc, char** argv, Config &cfg) {
     for (int i=1;i<argc;i++) {
         string a = argv[i];
@@ -140,6 +1825,7 @@ bool parse_args(int argc, char** argv, Config &cfg) {
         else if (a=="--workers" && i+1<argc) { cfg.workers = std::stoi(argv[++i]); }
         else if (a=="--tamper-percent" && i+1<argc) { cfg.tamper_percent = std::stod(argv[++i]); }
         else if (a=="--payload-bytes" && i+1<argc) { cfg.payload_bytes = std::stoi(argv[++i]); }
+        else if (a=="--payload-bytes-max" && i+1<argc) { cfg.payload_bytes_max = std::stoi(argv[++i]); }
         else if (a=="--node-jitter" && i+1<argc) { cfg.node_start_jitter_ms = std::stoi(argv[++i]); }
         else if (a=="--net-ta-node" && i+2<argc) {
             cfg.net_delay_ta_node_min = std::stoi(argv[++i]);
@@ -149,137 +1835,1865 @@ bool parse_args(int argc, char** argv, Config &cfg) {
             cfg.net_delay_node_mw_min = std::stoi(argv[++i]);
             cfg.net_delay_node_mw_max = std::stoi(argv[++i]);
         }
-        else if (a=="--db-delay" && i+2<argc) {
-            cfg.db_delay_min = std::stoi(argv[++i]);
-            cfg.db_delay_max = std::stoi(argv[++i]);
+        else if (a=="--db-delay" && i+2<argc) {
+            cfg.db_delay_min = std::stoi(argv[++i]);
+            cfg.db_delay_max = std::stoi(argv[++i]);
+        }
+        else if (a=="--fail-percent" && i+1<argc) { cfg.fail_percent = std::stod(argv[++i]); }
+        else if (a=="--seed" && i+1<argc) { cfg.seed = (long long)(std::stoull(argv[++i]) & 0x7FFFFFFFFFFFFFFFull); }
+        else if (a=="--out" && i+1<argc) { cfg.out_file = argv[++i]; }
+        else if (a=="--phase-csv" && i+1<argc) { cfg.phase_csv = argv[++i]; }
+        else if (a=="--stats" && i+1<argc) {
+            string st = argv[++i];
+            if (st == "exact") cfg.stats = StatsMode::Exact;
+            else if (st == "stream") cfg.stats = StatsMode::Stream;
+            else { cerr << "Unknown stats mode: " << st << "\n"; return false; }
+        }
+        else if (a=="--sketch-accuracy" && i+1<argc) { cfg.sketch_accuracy = std::stod(argv[++i]); }
+        else if (a=="--engine" && i+1<argc) {
+            string e = argv[++i];
+            if (e == "threads") cfg.engine = Engine::Threads;
+            else if (e == "des") cfg.engine = Engine::Des;
+            else if (e == "coro") cfg.engine = Engine::Coro;
+            else if (e == "pipeline") cfg.engine = Engine::Pipeline;
+            else { cerr << "Unknown engine: " << e << "\n"; return false; }
+        }
+        else if (a=="--scheduler" && i+1<argc) {
+            string sc = argv[++i];
+            if (sc == "steal") cfg.scheduler = Scheduler::Steal;
+            else if (sc == "counter") cfg.scheduler = Scheduler::Counter;
+            else { cerr << "Unknown scheduler: " << sc << "\n"; return false; }
+        }
+        else if (a=="--arrival-rate" && i+1<argc) { cfg.arrival_rate = std::stod(argv[++i]); }
+        else if (a=="--arrival" && i+1<argc) {
+            string ar = argv[++i];
+            if (ar == "poisson") cfg.arrival = ArrivalProcess::Poisson;
+            else if (ar == "constant") cfg.arrival = ArrivalProcess::Constant;
+            else { cerr << "Unknown arrival process: " << ar << "\n"; return false; }
+        }
+        else if (a=="--inflight" && i+1<argc) { cfg.inflight = std::stoi(argv[++i]); }
+        else if (a=="--ta-workers" && i+1<argc) { cfg.ta_workers = std::stoi(argv[++i]); }
+        else if (a=="--mw-workers" && i+1<argc) { cfg.mw_workers = std::stoi(argv[++i]); }
+        else if (a=="--requests-per-node" && i+1<argc) { cfg.requests_per_node = std::stoi(argv[++i]); }
+        else if (a=="--token-ttl-ms" && i+1<argc) { cfg.token_ttl_ms = std::stoi(argv[++i]); }
+        else if (a=="--token-max-uses" && i+1<argc) { cfg.token_max_uses = std::stoi(argv[++i]); }
+        else if (a=="--wire" && i+1<argc) {
+            string w = argv[++i];
+            if (w == "binary") cfg.wire = WireFormat::Binary;
+            else if (w == "hex") cfg.wire = WireFormat::Hex;
+            else { cerr << "Unknown wire format: " << w << "\n"; return false; }
+        }
+        else if (a=="--cipher" && i+1<argc) {
+            string c = argv[++i];
+            if (c == "cbc") cfg.cipher = CipherMode::Cbc;
+            else if (c == "gcm") cfg.cipher = CipherMode::Gcm;
+            else { cerr << "Unknown cipher mode: " << c << "\n"; return false; }
+        }
+        else if (a=="--mw-validation" && i+1<argc) {
+            string v = argv[++i];
+            if (v == "table") cfg.mw_validation = MwValidation::Table;
+            else if (v == "decrypt") cfg.mw_validation = MwValidation::Decrypt;
+            else if (v == "mac") cfg.mw_validation = MwValidation::Mac;
+            else { cerr << "Unknown mw validation: " << v << "\n"; return false; }
+        }
+        else if (a=="--no-crypto-ctx") { cfg.crypto_ctx = false; }
+        else if (a=="--no-arena") { cfg.arena = false; }
+        else if (a=="--force-scalar") { cfg.force_scalar = true; }
+        else if (a=="--stream-frame-bytes" && i+1<argc) { cfg.stream_frame_bytes = std::stoi(argv[++i]); }
+        else if (a=="--stream-window" && i+1<argc) { cfg.stream_window = std::stoi(argv[++i]); }
+        else if (a=="--chunk-bytes" && i+1<argc) { cfg.chunk_bytes = std::stoi(argv[++i]); }
+        else if (a=="--crypto-threads" && i+1<argc) { cfg.crypto_threads = std::stoi(argv[++i]); }
+        else if (a=="--keys" && i+1<argc) {
+            string k = argv[++i];
+            if (k == "precomputed") cfg.keys = KeyMode::Precomputed;
+            else if (k == "lazy") cfg.keys = KeyMode::Lazy;
+            else if (k == "shared") cfg.keys = KeyMode::Shared;
+            else { cerr << "Unknown key mode: " << k << "\n"; return false; }
+        }
+        else if (a=="--rotate-every-ms" && i+1<argc) { cfg.rotate_every_ms = std::stoi(argv[++i]); }
+        else if (a=="--bench" && i+1<argc) { cfg.bench = argv[++i]; }
+        else if (a=="--bench-iters" && i+1<argc) { cfg.bench_iters = std::stoi(argv[++i]); }
+        else if (a=="--bench-reps" && i+1<argc) { cfg.bench_reps = std::stoi(argv[++i]); }
+        else if (a=="--bench-out" && i+1<argc) { cfg.bench_out = argv[++i]; }
+        else if (a=="--help" || a=="-h") {
+            return false;
+        } else {
+            cerr << "Unknown arg: " << a << "\n";
+            return false;
+        }
+    }
+    if (cfg.nodes <= 0) cfg.nodes = 1000;
+    if (cfg.workers <= 0) cfg.workers = 1;
+    if (cfg.ta_workers <= 0) cfg.ta_workers = cfg.workers;
+    if (cfg.mw_workers <= 0) cfg.mw_workers = cfg.workers;
+    if (cfg.bench_iters <= 0) cfg.bench_iters = 1;
+    if (cfg.bench_reps <= 0) cfg.bench_reps = 1;
+    if (cfg.requests_per_node <= 0) cfg.requests_per_node = 1;
+    if (cfg.token_ttl_ms < 0) cfg.token_ttl_ms = 0;
+    if (cfg.token_max_uses < 0) cfg.token_max_uses = 0;
+    if (cfg.rotate_every_ms < 0) cfg.rotate_every_ms = 0;
+    if (cfg.arrival_rate < 0) cfg.arrival_rate = 0;
+    if (cfg.arrival_rate > 0) cfg.node_start_jitter_ms = 0;   // the arrival process replaces the start jitter
+    if (cfg.chunk_bytes < 0) cfg.chunk_bytes = 0;
+    // frame 0 must hold the whole token record
+    if (cfg.stream_frame_bytes < 0) cfg.stream_frame_bytes = 0;
+    if (cfg.stream_frame_bytes > 0 && cfg.stream_frame_bytes < (int)TOKEN_RECORD_BYTES) cfg.stream_frame_bytes = (int)TOKEN_RECORD_BYTES;
+    if (cfg.stream_window <= 0) cfg.stream_window = 1;
+    if (cfg.crypto_threads <= 0) cfg.crypto_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    if (cfg.tamper_percent < 0) cfg.tamper_percent = 0;
+    if (cfg.tamper_percent > 100) cfg.tamper_percent = 100;
+    if (cfg.fail_percent < 0) cfg.fail_percent = 0;
+    if (cfg.fail_percent > 100) cfg.fail_percent = 100;
+    cfg.sketch_accuracy = std::clamp(cfg.sketch_accuracy, 0.0001, 0.5);
+    return true;
+}
+
+void print_usage(const char* prog) {
+    cout << "Usage: " << prog << " [--nodes N] [--workers N] [--tamper-percent P] [--payload-bytes N]\n";
+    cout << "       [--node-jitter MS] [--net-ta-node MIN MAX] [--net-node-mw MIN MAX] [--db-delay MIN MAX]\n";
+    cout << "       [--fail-percent P] [--seed N] [--out filename] [--phase-csv filename] [--engine threads|des|coro|pipeline] [--inflight N] [--scheduler steal|counter]\n";
+    cout << "       [--ta-workers N] [--mw-workers N] [--stats exact|stream] [--sketch-accuracy A]\n";
+    cout << "       [--payload-bytes-max N] [--arrival-rate R] [--arrival poisson|constant]\n";
+    cout << "       [--requests-per-node N] [--token-ttl-ms MS] [--token-max-uses N]\n";
+    cout << "       [--cipher cbc|gcm] [--wire binary|hex] [--mw-validation table|decrypt|mac] [--no-crypto-ctx] [--no-arena] [--force-scalar]\n";
+    cout << "       [--keys precomputed|lazy|shared] [--rotate-every-ms MS] [--chunk-bytes N] [--crypto-threads N]\n";
+    cout << "       [--stream-frame-bytes N] [--stream-window N]\n";
+    cout << "       [--bench crypto-ctx|cipher-modes|hex|mw-table|mw-validation|token-reuse|key-directory|key-rotation|request-allocs|primitives|chunked|streaming|scheduler|results|arrival-sweep|quantiles]\n";
+    cout << "       [--bench-iters N] [--bench-reps N] [--bench-out file.json]\n";
+    cout << "Defaults: nodes=1000 workers=4 tamper-percent=0.0 payload-bytes=256 fail-percent=1.0\n";
+    cout << "Example: " << prog << " --nodes 1000 --workers 4 --tamper-percent 5 --payload-bytes 512 --fail-percent 2\n";
+}
+
+// ---------- Metrics ----------
+// Where a session's time goes. Delay phases record the time actually waited, so
+// oversleeping lands in the delay that was waited on; "other" in the report is the
+// remainder of the session time (scheduling gaps between requests).
+enum Phase { PhaseQueue, PhaseJitter, PhaseTaNet, PhaseTaIssue, PhaseTokenOpen, PhaseBuild, PhaseMwNet, PhaseAes, PhaseTokenCheck, PhaseDb, PHASE_COUNT };
+const char *const PHASE_NAMES[PHASE_COUNT] = {"queue", "jitter", "ta_net", "ta_issue", "token_open", "build", "mw_net", "aes", "token_check", "db"};
+
+// One entry per node; a node sends cfg.requests_per_node requests in its session.
+// Engines run with results sized to cfg.nodes and each node writes only its own slot,
+// so finishing a node takes no lock and workers never contend on a shared vector.
+struct NodeMetrics {
+    int node_index = -1;
+    long long total_us = 0;         // whole session
+    long long wire_bytes = 0;
+    int requests = 0;
+    int successes = 0;
+    int drops = 0;
+    int ta_issues = 0;              // tokens fetched from the TA
+    long long allocs = 0;           // heap allocations made by the protocol steps
+    long long max_buffer_bytes = 0; // largest request buffer footprint
+    long long queue_us = 0;         // open loop: intended start to actual start (included in total_us)
+    long long phase_ns[PHASE_COUNT] = {};   // session time per protocol phase
+};
+
+// Runs fn, charges its duration to phase p and returns it
+template <typename F>
+long long timed_phase(NodeMetrics &m, Phase p, F &&fn) {
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    m.phase_ns[p] += ns;
+    return ns;
+}
+
+void sleep_phase(NodeMetrics &m, Phase p, int ms) {
+    timed_phase(m, p, [&] { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); });
+}
+
+// Session time not covered by any phase
+long long other_phase_ns(const NodeMetrics &m) {
+    long long other = m.total_us * 1000;
+    for (long long ns : m.phase_ns) other -= ns;
+    return std::max(other, 0LL);
+}
+
+long long median_of_vec(std::vector<long long> v) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return (n % 2 == 1) ? v[n/2] : ((v[n/2 - 1] + v[n/2]) / 2);
+}
+
+// Nearest-rank percentile, q in (0, 1]
+long long percentile_of_vec(std::vector<long long> v, double q) {
+    if (v.empty()) return 0;
+    size_t rank = (size_t)std::ceil(q * v.size());
+    size_t k = std::min(v.size() - 1, rank > 0 ? rank - 1 : 0);
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// ---------- Latency histogram (HDR-style) ----------
+// Log-linear buckets: values below 2^SUB_BITS us are exact, and above that every
+// power-of-two range is split into 2^(SUB_BITS-1) equal buckets, so any recorded value
+// is known to within 1/1024 (three significant digits). Fixed size whatever the run
+// length; min, max and the sum are kept exactly.
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 11;
+    static constexpr int MAX_BITS = 36;     // up to ~19 h in us; larger values land in the top bucket
+    static constexpr uint64_t SUB_COUNT = 1ull << SUB_BITS;
+    static constexpr uint64_t HALF = SUB_COUNT / 2;
+    static constexpr size_t BUCKETS = SUB_COUNT + (MAX_BITS - SUB_BITS) * HALF;
+
+    LatencyHistogram() : counts_(BUCKETS, 0) {}
+
+    void record(long long us) {
+        uint64_t v = (uint64_t)std::max(us, 0LL);
+        ++counts_[index_of(v)];
+        ++count_;
+        sum_ += v;
+        min_ = std::min(min_, v);
+        max_ = std::max(max_, v);
+    }
+
+    void merge(const LatencyHistogram &o) {
+        for (size_t i = 0; i < BUCKETS; ++i) counts_[i] += o.counts_[i];
+        count_ += o.count_;
+        sum_ += o.sum_;
+        min_ = std::min(min_, o.min_);
+        max_ = std::max(max_, o.max_);
+    }
+
+    long long count() const { return (long long)count_; }
+    long long min() const { return count_ ? (long long)min_ : 0; }
+    long long max() const { return (long long)max_; }
+    double mean() const { return count_ ? (double)sum_ / count_ : 0.0; }
+
+    // Smallest recorded value v with at least q of the samples <= v, to bucket precision
+    long long value_at(double q) const {
+        if (count_ == 0) return 0;
+        if (q <= 0.0) return (long long)min_;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= target) return i == BUCKETS - 1 ? (long long)max_ : (long long)std::clamp(highest_of(i), min_, max_);
+        }
+        return (long long)max_;
+    }
+
+private:
+    static size_t index_of(uint64_t v) {
+        if (v < SUB_COUNT) return (size_t)v;
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= MAX_BITS) return BUCKETS - 1;
+        int shift = msb - SUB_BITS + 1;
+        return (size_t)(SUB_COUNT + (uint64_t)(shift - 1) * HALF + ((v >> shift) - HALF));
+    }
+
+    static uint64_t highest_of(size_t idx) {
+        if (idx < SUB_COUNT) return idx;
+        uint64_t k = idx - SUB_COUNT;
+        int shift = (int)(k / HALF) + 1;
+        uint64_t sub = k % HALF + HALF;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0, sum_ = 0;
+    uint64_t min_ = UINT64_MAX, max_ = 0;
+};
+
+// One T per recording thread, so recording takes no lock; merged() folds them together
+// once the run is over. The Ts are owned here, so threads may exit first.
+template <typename T>
+class PerThread {
+public:
+    // This thread's T; the thread_local cache is per T, so keep one PerThread per type
+    T &local() {
+        thread_local T *mine = nullptr;
+        thread_local uint64_t mine_generation = UINT64_MAX;
+        uint64_t gen = generation_.load(std::memory_order_acquire);
+        if (mine_generation != gen) {
+            std::lock_guard<std::mutex> lk(mu_);
+            items_.push_back(std::make_unique<T>());
+            mine = items_.back().get();
+            mine_generation = gen;
+        }
+        return *mine;
+    }
+
+    T merged() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        T out;
+        for (const auto &t : items_) out.merge(*t);
+        return out;
+    }
+
+    // Drops every thread's T; threads register a fresh one on their next local()
+    void reset() {
+        std::lock_guard<std::mutex> lk(mu_);
+        items_.clear();
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    mutable std::mutex mu_;
+    std::vector<std::unique_ptr<T>> items_;
+    std::atomic<uint64_t> generation_{0};
+};
+
+PerThread<LatencyHistogram> g_latency;   // node session times of the current simulation run (--stats exact)
+
+// ---------- Streaming statistics (--stats stream) ----------
+// DDSketch: bucket k counts values in (gamma^(k-1), gamma^k] with gamma = (1+a)/(1-a),
+// so every quantile comes back within relative error a of a true sample. Sketches
+// merge bucket by bucket. Past max_bins the lowest buckets are folded together, which
+// only coarsens the lowest quantiles; even at 0.1% that takes 14 decades of values.
+double g_sketch_accuracy = 0.01;
+
+class DDSketch {
+public:
+    explicit DDSketch(double accuracy = g_sketch_accuracy, size_t max_bins = 16384)
+        : accuracy_(accuracy), gamma_((1.0 + accuracy) / (1.0 - accuracy)), log_gamma_(std::log(gamma_)), max_bins_(max_bins) {}
+
+    void add(double v) {
+        ++count_;
+        sum_ += v;
+        min_ = std::min(min_, v);
+        max_ = std::max(max_, v);
+        if (v <= 0.0) {
+            ++zero_count_;
+            return;
+        }
+        int k = key_of(v);
+        grow(k, k);
+        ++bins_[k - offset_];
+        collapse();
+    }
+
+    void merge(const DDSketch &o) {
+        if (o.count_ == 0) return;
+        count_ += o.count_;
+        zero_count_ += o.zero_count_;
+        sum_ += o.sum_;
+        min_ = std::min(min_, o.min_);
+        max_ = std::max(max_, o.max_);
+        if (o.bins_.empty()) return;
+        grow(o.offset_, o.offset_ + (int)o.bins_.size() - 1);
+        for (size_t i = 0; i < o.bins_.size(); ++i) bins_[o.offset_ - offset_ + i] += o.bins_[i];
+        collapse();
+    }
+
+    long long count() const { return (long long)count_; }
+    double mean() const { return count_ ? sum_ / count_ : 0.0; }
+    double min() const { return count_ ? min_ : 0.0; }
+    double max() const { return count_ ? max_ : 0.0; }
+    double relative_accuracy() const { return accuracy_; }
+    size_t bins() const { return bins_.size(); }
+    bool collapsed() const { return collapsed_; }
+
+    // Same rank rule as LatencyHistogram::value_at
+    double value_at(double q) const {
+        if (count_ == 0) return 0.0;
+        if (q <= 0.0) return min_;
+        if (q >= 1.0) return max_;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * count_));
+        uint64_t seen = zero_count_;
+        if (seen >= target) return 0.0;
+        for (size_t i = 0; i < bins_.size(); ++i) {
+            seen += bins_[i];
+            if (seen >= target) return std::clamp(value_of(offset_ + (int)i), min_, max_);
+        }
+        return max_;
+    }
+
+private:
+    int key_of(double v) const { return (int)std::ceil(std::log(v) / log_gamma_); }
+    double value_of(int k) const { return 2.0 * std::pow(gamma_, k) / (gamma_ + 1.0); }
+
+    void grow(int lo, int hi) {
+        if (bins_.empty()) {
+            offset_ = lo;
+            bins_.assign((size_t)(hi - lo + 1), 0);
+            return;
+        }
+        if (lo < offset_) {
+            bins_.insert(bins_.begin(), (size_t)(offset_ - lo), 0);
+            offset_ = lo;
+        }
+        int top = offset_ + (int)bins_.size() - 1;
+        if (hi > top) bins_.resize(bins_.size() + (size_t)(hi - top), 0);
+    }
+
+    void collapse() {
+        if (bins_.size() <= max_bins_) return;
+        size_t extra = bins_.size() - max_bins_;
+        uint64_t folded = 0;
+        for (size_t i = 0; i <= extra; ++i) folded += bins_[i];
+        bins_.erase(bins_.begin(), bins_.begin() + extra);
+        bins_[0] = folded;
+        offset_ += (int)extra;
+        collapsed_ = true;
+    }
+
+    double accuracy_, gamma_, log_gamma_;
+    size_t max_bins_;
+    int offset_ = 0;                // key of bins_[0]
+    std::vector<uint64_t> bins_;
+    uint64_t count_ = 0, zero_count_ = 0;
+    double sum_ = 0.0, min_ = HUGE_VAL, max_ = 0.0;
+    bool collapsed_ = false;
+};
+
+// Counters summed over node sessions; everything summarize() reports besides quantiles
+struct RunTotals {
+    long long nodes = 0, requests = 0, ta_issues = 0, successes = 0, drops = 0;
+    long long wire_bytes = 0, allocs = 0, max_buffer_bytes = 0, queue_us = 0;
+    long long sent_requests = 0, sent_us = 0;   // sessions with at least one delivered request
+
+    void add(const NodeMetrics &m) {
+        ++nodes;
+        requests += m.requests;
+        ta_issues += m.ta_issues;
+        successes += m.successes;
+        drops += m.drops;
+        wire_bytes += m.wire_bytes;
+        allocs += m.allocs;
+        max_buffer_bytes = std::max(max_buffer_bytes, m.max_buffer_bytes);
+        queue_us += m.queue_us;
+        // A session where every request dropped has no meaningful latency
+        if (m.drops < m.requests) {
+            sent_requests += m.requests;
+            sent_us += m.total_us;
+        }
+    }
+
+    void merge(const RunTotals &o) {
+        nodes += o.nodes;
+        requests += o.requests;
+        ta_issues += o.ta_issues;
+        successes += o.successes;
+        drops += o.drops;
+        wire_bytes += o.wire_bytes;
+        allocs += o.allocs;
+        max_buffer_bytes = std::max(max_buffer_bytes, o.max_buffer_bytes);
+        queue_us += o.queue_us;
+        sent_requests += o.sent_requests;
+        sent_us += o.sent_us;
+    }
+};
+
+// Constant-size stand-in for the results vector: totals plus one sketch for node
+// session times and one per phase ("other" last), all in us
+struct StreamStats {
+    RunTotals totals;
+    DDSketch total_us;
+    DDSketch phase_us[PHASE_COUNT + 1];
+
+    void add(const NodeMetrics &m) {
+        totals.add(m);
+        if (m.drops < m.requests) total_us.add((double)m.total_us);
+        for (int p = 0; p < PHASE_COUNT; ++p) phase_us[p].add(m.phase_ns[p] / 1000.0);
+        phase_us[PHASE_COUNT].add(other_phase_ns(m) / 1000.0);
+    }
+
+    void merge(const StreamStats &o) {
+        totals.merge(o.totals);
+        total_us.merge(o.total_us);
+        for (int p = 0; p <= PHASE_COUNT; ++p) phase_us[p].merge(o.phase_us[p]);
+    }
+};
+
+PerThread<StreamStats> g_stream_stats;
+StatsMode g_stats_mode = StatsMode::Exact;   // set by main for simulation runs; benches always keep results
+
+// Every engine hands each finished node here: exact mode keeps it in its results slot
+// and its session time in this thread's histogram, stream mode folds it into this
+// thread's sketches and keeps nothing per node.
+void node_done(std::vector<NodeMetrics> &results, NodeMetrics &m) {
+    if (g_stats_mode == StatsMode::Stream) {
+        g_stream_stats.local().add(m);
+        return;
+    }
+    if (m.drops < m.requests) g_latency.local().record(m.total_us);
+    results[m.node_index] = std::move(m);
+}
+
+// ---------- Per-request random draws ----------
+// Payload size of a node. With --payload-bytes-max every node gets a fixed size spread
+// log-uniformly over [payload_bytes, payload_bytes_max], hashed from its number, so the
+// mix is the same whichever engine or scheduler runs it.
+size_t payload_bytes_for(const Config &cfg, int node) {
+    if (cfg.payload_bytes_max <= cfg.payload_bytes) return (size_t)cfg.payload_bytes;
+    uint64_t h = (uint64_t)node * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 29;
+    double u = (double)(h >> 11) / (double)(1ull << 53);
+    double lo = std::log((double)std::max(cfg.payload_bytes, 1)), hi = std::log((double)cfg.payload_bytes_max);
+    return (size_t)std::exp(lo + u * (hi - lo));
+}
+
+struct NodeDraws {
+    int jitter_ms = 0;          // first request of a session only
+    int net_ta_node_ms = 0;     // only paid when the node fetches a token
+    bool dropped = false;
+    bool tampered = false;
+    int net_node_mw_ms = 0;
+    int db_delay_ms = 0;
+};
+
+// ---------- Per-node random streams (Philox4x32-10) ----------
+// Counter-based: a (counter, key) pair maps straight to 128 random bits, with no state
+// carried between draws. Keyed by --seed and counted by (node, request), a node's
+// delays, drops and tamper decisions are the same whichever worker, engine, scheduler
+// or process runs it, and a stream costs nothing to split off.
+using PhiloxBlock = std::array<uint32_t, 4>;
+
+PhiloxBlock philox4x32(PhiloxBlock ctr, uint64_t key) {
+    uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+    for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * ctr[0];
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr[2];
+        ctr = {(uint32_t)(p1 >> 32) ^ ctr[1] ^ k0, (uint32_t)p1, (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1, (uint32_t)p0};
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    return ctr;
+}
+
+// Last counter word: which kind of draw, so streams never share a counter
+enum RandomStream : uint32_t { StreamRequest, StreamArrival };
+
+// Simulation draws only; IVs, nonces and tokens come from the crypto DRBG (random_block)
+PhiloxBlock philox_block(uint64_t seed, RandomStream stream, uint32_t a, uint32_t b = 0, uint32_t c = 0) {
+    return philox4x32({a, b, c, stream}, seed);
+}
+
+// Uniform in [lo, hi] by multiply-shift (bias below 2^-32 per value)
+int random_int(uint32_t x, int lo, int hi) {
+    if (hi <= lo) return lo;
+    return lo + (int)(((uint64_t)x * (uint64_t)((long long)hi - lo + 1)) >> 32);
+}
+
+// Uniform in (0, 1), never exactly 0 or 1
+double random_unit(uint32_t x) { return (x + 0.5) / 4294967296.0; }
+
+struct NodeDistributions {
+    uint64_t seed;
+    int jitter_max;
+    int net_ta_node_min, net_ta_node_max;
+    int net_node_mw_min, net_node_mw_max;
+    int db_delay_min, db_delay_max;
+    double fail_p, tamper_p;
+
+    explicit NodeDistributions(const Config &cfg)
+        : seed((uint64_t)cfg.seed), jitter_max(cfg.node_start_jitter_ms),
+          net_ta_node_min(cfg.net_delay_ta_node_min), net_ta_node_max(cfg.net_delay_ta_node_max),
+          net_node_mw_min(cfg.net_delay_node_mw_min), net_node_mw_max(cfg.net_delay_node_mw_max),
+          db_delay_min(cfg.db_delay_min), db_delay_max(cfg.db_delay_max),
+          fail_p(cfg.fail_percent / 100.0), tamper_p(cfg.tamper_percent / 100.0) {}
+
+    // Request r of node idx: two Philox blocks, one word per draw
+    NodeDraws draw(int idx, int r) const {
+        PhiloxBlock a = philox_block(seed, StreamRequest, (uint32_t)idx, (uint32_t)r, 0);
+        PhiloxBlock b = philox_block(seed, StreamRequest, (uint32_t)idx, (uint32_t)r, 1);
+        NodeDraws d;
+        d.jitter_ms = random_int(a[0], 0, jitter_max);
+        d.net_ta_node_ms = random_int(a[1], net_ta_node_min, net_ta_node_max);
+        d.dropped = random_unit(a[2]) < fail_p;
+        d.tampered = random_unit(a[3]) < tamper_p;
+        d.net_node_mw_ms = random_int(b[0], net_node_mw_min, net_node_mw_max);
+        d.db_delay_ms = random_int(b[1], db_delay_min, db_delay_max);
+        return d;
+    }
+};
+
+// ---------- Open-loop arrivals (--arrival-rate R) ----------
+// Closed loop (the default) starts a node whenever a worker frees up, so a slow system
+// is offered less load. Open loop gives node i an intended start time from a Poisson
+// or constant-rate process, independent of completions. Nodes that find every worker
+// busy queue, and their latency runs from the intended start, queueing included, so
+// coordinated omission doesn't hide the backlog.
+struct Arrivals {
+    std::vector<long long> at_ns;   // intended start of node i after the run starts; empty = closed loop
+    std::chrono::steady_clock::time_point origin;   // real-time engines: set by start()
+
+    bool open() const { return !at_ns.empty(); }
+    void start() { origin = std::chrono::steady_clock::now(); }
+    std::chrono::steady_clock::time_point intended(int idx) const {
+        return origin + std::chrono::nanoseconds(at_ns[idx]);
+    }
+};
+
+// Real-time engines: calls arrive(i) at node i's intended start
+template <typename F>
+void dispatch_arrivals(const Arrivals &a, F &&arrive) {
+    for (int i = 0; i < (int)a.at_ns.size(); ++i) {
+        std::this_thread::sleep_until(a.intended(i));
+        arrive(i);
+    }
+}
+
+// The gap after node i is its own Philox draw, so the schedule depends only on --seed
+Arrivals make_arrivals(const Config &cfg) {
+    Arrivals a;
+    if (cfg.arrival_rate <= 0) return a;
+    a.at_ns.reserve(cfg.nodes);
+    double t = 0.0;
+    for (int i = 0; i < cfg.nodes; ++i) {
+        a.at_ns.push_back((long long)(t * 1e9));
+        if (cfg.arrival == ArrivalProcess::Constant) t += 1.0 / cfg.arrival_rate;
+        else t += -std::log(random_unit(philox_block((uint64_t)cfg.seed, StreamArrival, (uint32_t)i)[0])) / cfg.arrival_rate;
+    }
+    return a;
+}
+
+// ---------- Protocol steps (shared by every engine) ----------
+// Node-side token cache: a token is reused until it expires or hits g_token_max_uses.
+// Nodes pick up rotated keys from g_keys, like a device receiving a rekey.
+struct NodeSession {
+    int idx;
+    string node_id;
+    IssuedTokens issued;        // reused across fetches, so its buffers keep their capacity
+    byte record[TOKEN_RECORD_BYTES] = {};   // decrypted packed token as the node holds it
+    bool have_token = false;
+    int uses = 0;
+
+    explicit NodeSession(int i) : idx(i), node_id(node_id_string((uint32_t)i)) {}
+
+    bool needs_token(long long now_ms) const {
+        if (!have_token) return true;
+        if (g_token_max_uses > 0 && uses >= g_token_max_uses) return true;
+        // mac and decrypt tokens are bound to the TA<->MW key of their epoch
+        if (g_mw_validation != MwValidation::Table && !g_keys.accepts(issued.key_epoch)) return true;
+        return TokenRecord::unpack(record).expired(now_ms);
+    }
+};
+
+// Request layout: [token record:32][body: body_bytes x body_fill]. The plaintext is only
+// assembled inside node_send_and_mw_validate, in that step's arena scope.
+struct NodeRequest {
+    uint32_t node_num = 0;
+    string node_id;
+    uint32_t token_epoch = 0;   // epoch of enc_for_mw
+    uint32_t seal_epoch = 0;    // key epoch in force when the node built the request, before its node->MW delay
+    const string *enc_for_mw = nullptr;    // session's TA->MW message (decrypt mode only); the session outlives the request
+    byte record[TOKEN_RECORD_BYTES];
+    size_t body_bytes = 0;
+    char body_fill = 'A';
+    size_t wire_bytes = 0;      // encrypted bytes sent for this request
+    size_t buffer_bytes = 0;    // request buffers held at once while sending and validating it
+};
+
+// Node decrypts and caches the token the TA just issued into s.issued. Returns TA->Node + TA->MW bytes.
+size_t node_open_token(NodeSession &s) {
+    size_t bytes = KEY_EPOCH_BYTES + s.issued.enc_for_node.size();
+    if (!s.issued.enc_for_mw.empty()) bytes += KEY_EPOCH_BYTES + s.issued.enc_for_mw.size();
+    s.uses = 0;
+
+    KeyRing::ReadGuard keys(g_keys);
+    const KeySet *ks = keys.at(s.issued.key_epoch);
+    if (!ks) {
+        g_stale_epoch_rejects.fetch_add(1, std::memory_order_relaxed);
+        // Rotated out in transit: the node can't open it, so its request carries a blank token
+        std::memset(s.record, 0, TOKEN_RECORD_BYTES);
+        s.have_token = false;
+        return bytes;
+    }
+    CryptoPP::SecByteBlock &key = scratch_key();
+    ks->node_key_into(KeyDirectory::Key::TaNode, (uint32_t)s.idx, key);
+    if (aesDecryptMsgInto(key, s.issued.enc_for_node, s.node_id, false, s.record) != TOKEN_RECORD_BYTES)
+        throw std::runtime_error("Bad token record size");
+    s.have_token = true;
+    return bytes;
+}
+
+// TA issues a token, node decrypts and caches it
+size_t node_fetch_token(NodeSession &s) {
+    TA_issue_tokens_into((uint32_t)s.idx, s.issued);
+    return node_open_token(s);
+}
+
+// Node builds its request for the middleware from the cached token
+NodeRequest node_build_request(NodeSession &s, const Config &cfg, bool tamper) {
+    NodeRequest req;
+    req.node_num = (uint32_t)s.idx;
+    req.node_id = s.node_id;
+    req.token_epoch = s.issued.key_epoch;
+    req.seal_epoch = g_keys.epoch();
+    req.enc_for_mw = &s.issued.enc_for_mw;
+    std::memcpy(req.record, s.record, TOKEN_RECORD_BYTES);
+    req.body_bytes = payload_bytes_for(cfg, s.idx);
+    req.body_fill = 'A' + (s.idx % 26);
+    ++s.uses;
+
+    // Maybe tamper
+    if (tamper) {
+        random_block(req.record + 4, TOKEN_BYTES);
+    }
+    return req;
+}
+
+// Time this thread has spent in mw_check_token, so callers can split it out of the send/validate step
+thread_local long long t_token_check_ns = 0;
+
+struct ScopedNs {
+    long long &acc;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    ~ScopedNs() { acc += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count(); }
+};
+
+// Middleware-side token check on the decrypted request header
+bool mw_check_token(const KeyRing::ReadGuard &keys, const NodeRequest &req, const byte *presented) {
+    ScopedNs timer{t_token_check_ns};
+    long long now_ms = protocol_now_ms();
+    if (g_mw_validation == MwValidation::Table) return g_mw_tokens.validate(presented, now_ms);
+    if (g_mw_validation == MwValidation::Mac) return verify_mac_token(presented, now_ms, keys);
+
+    const KeySet *token_keys = keys.at(req.token_epoch);
+    if (!token_keys) {
+        g_stale_epoch_rejects.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    byte expected[TOKEN_RECORD_BYTES];
+    if (aesDecryptMsgInto(token_keys->ta_mw, *req.enc_for_mw, req.node_id, false, expected) != TOKEN_RECORD_BYTES) return false;
+    if (!token_records_equal(presented, expected)) return false;
+    return !TokenRecord::unpack(presented).expired(now_ms);
+}
+
+// Streamed body (--stream-frame-bytes N): the node produces and seals the request one
+// frame at a time into a ring of g_stream_window slots, and the middleware opens frames
+// from the ring as they arrive. A full ring stalls the node until the middleware frees a
+// slot, so the request holds O(window x frame) bytes whatever the body size. Frames use
+// the chunked nonce/aad scheme behind a stream header (wire version 4); each frame goes
+// out as [len:4][cipher][tag:16]. The token rides in frame 0, so a bad token stops the
+// stream before the rest of the body is sent.
+constexpr byte WIRE_VERSION_STREAM = 4;
+constexpr size_t STREAM_FRAME_PREFIX_BYTES = 4;
+
+size_t g_stream_frame_bytes = 0;
+size_t g_stream_window = 4;
+
+bool use_streaming(size_t plain_len) {
+    return g_stream_frame_bytes > 0 && plain_len > g_stream_frame_bytes;
+}
+
+bool node_stream_and_mw_validate(NodeRequest &req, const KeyRing::ReadGuard &keys, const KeySet &ks,
+                                 const CryptoPP::SecByteBlock &node_key, ArenaScope &arena) {
+    size_t frame = g_stream_frame_bytes;
+    size_t plain_len = TOKEN_RECORD_BYTES + req.body_bytes;
+    size_t count = chunk_count(plain_len, frame);
+    size_t slot_bytes = STREAM_FRAME_PREFIX_BYTES + frame + GCM_TAG_BYTES;
+
+    byte header[CHUNKED_HEADER_BYTES];
+    header[0] = WIRE_VERSION_STREAM;
+    random_block(header + 1, CHUNK_NONCE_PREFIX_BYTES);
+    put_be32(header + 1 + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)frame);
+    put_be32(header + 5 + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)count);
+    put_be32(header + 9 + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)plain_len);
+    req.wire_bytes += KEY_EPOCH_BYTES + CHUNKED_HEADER_BYTES;
+
+    // Middleware looks up the node's key in the epoch named by the stream header
+    CryptoPP::SecByteBlock &mw_key = scratch_key(1);
+    ks.node_key_into(KeyDirectory::Key::NodeMw, req.node_num, mw_key);
+
+    std::span<byte> ring = arena.alloc(g_stream_window * slot_bytes);
+    std::span<byte> node_plain = arena.alloc(frame);
+    std::span<byte> mw_plain = arena.alloc(frame);
+    auto nonce_for = [&](size_t i, byte *nonce) {
+        std::memcpy(nonce, header + 1, CHUNK_NONCE_PREFIX_BYTES);
+        put_be32(nonce + CHUNK_NONCE_PREFIX_BYTES, (uint32_t)i);
+    };
+
+    // Node side: fill frame i of the plaintext and seal it into its ring slot
+    auto produce = [&](size_t i) {
+        size_t at = i * frame;
+        size_t len = std::min(frame, plain_len - at);
+        size_t fill_from = 0;
+        if (at < TOKEN_RECORD_BYTES) {
+            fill_from = std::min(len, TOKEN_RECORD_BYTES - at);
+            std::memcpy(node_plain.data(), req.record + at, fill_from);
+        }
+        std::memset(node_plain.data() + fill_from, req.body_fill, len - fill_from);
+        byte nonce[GCM_NONCE_BYTES];
+        nonce_for(i, nonce);
+        std::span<byte> slot = ring.subspan((i % g_stream_window) * slot_bytes, slot_bytes);
+        size_t n = aesSealInto(CipherMode::Gcm, node_key, nonce, node_plain.first(len),
+                               chunk_aad(req.node_id, (uint32_t)i, (uint32_t)count), false, slot.subspan(STREAM_FRAME_PREFIX_BYTES));
+        put_be32(slot.data(), (uint32_t)n);
+        req.wire_bytes += STREAM_FRAME_PREFIX_BYTES + n;
+    };
+
+    // Middleware side: open frame i from its slot; frame 0 carries the token
+    auto consume = [&](size_t i) {
+        std::span<const byte> slot = ring.subspan((i % g_stream_window) * slot_bytes, slot_bytes);
+        size_t n = get_be32(slot.data());
+        if (n > frame + GCM_TAG_BYTES) return false;
+        byte nonce[GCM_NONCE_BYTES];
+        nonce_for(i, nonce);
+        size_t len = aesOpenInto(CipherMode::Gcm, mw_key, nonce, slot.subspan(STREAM_FRAME_PREFIX_BYTES, n),
+                                 chunk_aad(req.node_id, (uint32_t)i, (uint32_t)count), false, mw_plain);
+        if (i > 0) return true;
+        if (len < TOKEN_RECORD_BYTES) return false;
+        return mw_check_token(keys, req, mw_plain.data());
+    };
+
+    size_t produced = 0, consumed = 0;
+    while (consumed < count) {
+        if (produced < count && produced - consumed < g_stream_window) {
+            produce(produced++);
+        } else if (!consume(consumed++)) {
+            return false;   // middleware rejects; the node stops sending
+        }
+    }
+    return true;
+}
+
+// Node encrypts the request under req.seal_epoch, middleware decrypts it and checks the token record.
+// The epoch was fixed when the request was built, before the node->MW delay, and is resolved
+// here under a fresh guard: a rotation during transit that pushed it out of the accepted
+// window makes the middleware reject the message as stale. The AES work itself is done
+// here, on one thread, with the keys of that epoch.
+// Every buffer comes from the thread's arena; the string path is kept for --no-arena and the hex wire.
+bool node_send_and_mw_validate(NodeRequest &req) {
+    KeyRing::ReadGuard keys(g_keys);
+    const KeySet *ks = keys.at(req.seal_epoch);
+    if (!ks) {
+        g_stale_epoch_rejects.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    CryptoPP::SecByteBlock &key = scratch_key();
+    ks->node_key_into(KeyDirectory::Key::NodeMw, req.node_num, key);
+
+    if (!span_wire()) {
+        string full_request((const char*)req.record, TOKEN_RECORD_BYTES);
+        full_request.append(req.body_bytes, req.body_fill);
+        string encrypted_for_mw = aesEncryptMsg(key, full_request, req.node_id);
+        req.wire_bytes += KEY_EPOCH_BYTES + encrypted_for_mw.size();
+        req.buffer_bytes = full_request.size() + encrypted_for_mw.size();
+
+        // Middleware resolves the message's epoch and looks up the node's key
+        ks->node_key_into(KeyDirectory::Key::NodeMw, req.node_num, key);
+        string node_request_plain = aesDecryptMsg(key, encrypted_for_mw, req.node_id);
+        req.buffer_bytes += node_request_plain.size();
+        if (node_request_plain.size() < TOKEN_RECORD_BYTES) return false;
+        return mw_check_token(keys, req, (const byte*)node_request_plain.data());
+    }
+
+    ArenaScope arena;
+    size_t plain_len = TOKEN_RECORD_BYTES + req.body_bytes;
+    if (use_streaming(plain_len)) {
+        bool ok = node_stream_and_mw_validate(req, keys, *ks, key, arena);
+        req.buffer_bytes = arena.bytes();
+        return ok;
+    }
+    std::span<byte> plain = arena.alloc(plain_len);
+    std::memcpy(plain.data(), req.record, TOKEN_RECORD_BYTES);
+    std::memset(plain.data() + TOKEN_RECORD_BYTES, req.body_fill, req.body_bytes);
+    bool chunked = use_chunked(plain_len);
+    std::span<byte> frame = arena.alloc(chunked ? chunked_frame_bytes(plain_len, g_chunk_bytes) : frame_bytes(g_cipher_mode, plain_len, true));
+    std::span<byte> recovered = arena.alloc(frame.size());
+    req.buffer_bytes = arena.bytes();
+    size_t frame_len = chunked ? aesEncryptChunkedInto(*g_chunk_pool, key, plain, req.node_id, g_chunk_bytes, frame)
+                               : aesEncryptFrameInto(key, plain, req.node_id, true, frame);
+    req.wire_bytes += KEY_EPOCH_BYTES + frame_len;
+
+    // Middleware resolves the message's epoch, looks up the node's key, then decrypts & validates
+    ks->node_key_into(KeyDirectory::Key::NodeMw, req.node_num, key);
+    size_t n = chunked ? aesDecryptChunkedInto(*g_chunk_pool, key, frame.first(frame_len), req.node_id, recovered)
+                       : aesDecryptFrameInto(key, frame.first(frame_len), req.node_id, true, recovered);
+    if (n < TOKEN_RECORD_BYTES) return false;
+    return mw_check_token(keys, req, recovered.data());
+}
+
+// Token fetch (when needed) and request build, with allocations and phases recorded.
+// Returns the CPU time spent.
+long long node_prepare_request(NodeMetrics &m, NodeSession &s, const Config &cfg, bool fetch, bool tampered, NodeRequest &req) {
+    long long ns = 0;
+    m.allocs += count_allocs([&] {
+        if (fetch) {
+            ns += timed_phase(m, PhaseTaIssue, [&] { TA_issue_tokens_into((uint32_t)s.idx, s.issued); });
+            ns += timed_phase(m, PhaseTokenOpen, [&] { m.wire_bytes += (long long)node_open_token(s); });
+            ++m.ta_issues;
+        }
+        ns += timed_phase(m, PhaseBuild, [&] { req = node_build_request(s, cfg, tampered); });
+    });
+    return ns;
+}
+
+// node_send_and_mw_validate with its result recorded and its time split into aes and
+// token_check. Returns the CPU time spent.
+long long node_send_recorded(NodeMetrics &m, NodeRequest &req) {
+    long long check_before = t_token_check_ns;
+    auto t0 = std::chrono::steady_clock::now();
+    m.allocs += count_allocs([&] { m.successes += node_send_and_mw_validate(req); });
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    long long check_ns = t_token_check_ns - check_before;
+    m.phase_ns[PhaseTokenCheck] += check_ns;
+    m.phase_ns[PhaseAes] += ns - check_ns;
+    m.wire_bytes += (long long)req.wire_bytes;
+    m.max_buffer_bytes = std::max(m.max_buffer_bytes, (long long)req.buffer_bytes);
+    return ns;
+}
+
+// ---------- Worker (threads engine: real sleeps) ----------
+// Request r of a session, sleeps included; shared by both schedulers
+void thread_request(const Config &cfg, const NodeDistributions &dists, NodeSession &session, NodeMetrics &m, int r) {
+    NodeDraws d = dists.draw(session.idx, r);
+
+    // Staggered node start
+    if (r == 0) sleep_phase(m, PhaseJitter, d.jitter_ms);
+
+    // Simulate network delay TA -> Node, only when the cached token can't be used
+    bool fetch = session.needs_token(protocol_now_ms());
+    if (fetch) sleep_phase(m, PhaseTaNet, d.net_ta_node_ms);
+
+    // Simulate random drop/failure
+    ++m.requests;
+    if (d.dropped) {
+        ++m.drops;
+        return;
+    }
+
+    NodeRequest req;
+    node_prepare_request(m, session, cfg, fetch, d.tampered, req);
+
+    // Simulate network delay Node -> MW
+    sleep_phase(m, PhaseMwNet, d.net_node_mw_ms);
+
+    node_send_recorded(m, req);
+
+    // Simulate DB write delay
+    sleep_phase(m, PhaseDb, d.db_delay_ms);
+}
+
+// --scheduler counter: nodes handed out by one shared counter. Open loop hands them
+// out in arrival order, so a worker waits for its node's arrival, or starts it late
+// when every worker was busy.
+void worker_func(std::atomic<int> &counter, const Config &cfg, const Arrivals &arrivals, std::vector<NodeMetrics> &results) {
+    NodeDistributions dists(cfg);
+
+    while (true) {
+        int idx = counter.fetch_add(1);
+        if (idx >= cfg.nodes) break;
+        NodeMetrics m{};
+        m.node_index = idx;
+        if (arrivals.open()) {
+            auto due = arrivals.intended(idx);
+            std::this_thread::sleep_until(due);
+            m.queue_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - due).count();
+        }
+        NodeSession session(idx);
+        using clk = std::chrono::high_resolution_clock;
+        auto t_start = clk::now();
+
+        for (int r = 0; r < cfg.requests_per_node; ++r) thread_request(cfg, dists, session, m, r);
+
+        auto t_end = clk::now();
+        m.total_us = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count() + m.queue_us;
+        m.phase_ns[PhaseQueue] += m.queue_us * 1000;
+        node_done(results, m);
+    }
+}
+
+// ---------- Work-stealing scheduler (threads engine, --scheduler steal) ----------
+// One deque per worker. A worker pushes and pops its own tasks at the back, so a
+// session's follow-up request runs next on the same core with its keys and buffers
+// still warm. An idle worker steals from the front of another worker's deque, taking
+// the oldest work. Tasks may push follow-ups; run() returns once every task, spawned
+// ones included, has finished.
+class StealPool {
+public:
+    using Task = std::function<void(int worker)>;
+
+    struct alignas(64) WorkerStats {
+        long long tasks = 0, steals = 0;
+        double busy_s = 0.0;    // time spent inside tasks
+    };
+
+    explicit StealPool(int workers) : queues_(workers), stats_(workers) {}
+
+    int workers() const { return (int)queues_.size(); }
+
+    // Seeds before run(), or spawns a follow-up from inside a task on that worker
+    void push(int worker, Task t) {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        Queue &q = queues_[worker];
+        std::lock_guard<std::mutex> lk(q.mu);
+        q.tasks.push_back(std::move(t));
+    }
+
+    void run() {
+        std::vector<std::thread> threads;
+        threads.reserve(queues_.size());
+        for (int w = 0; w < workers(); ++w) threads.emplace_back([this, w] { work(w); });
+        for (auto &t : threads) t.join();
+    }
+
+    const std::vector<WorkerStats> &stats() const { return stats_; }
+
+    // Keeps workers alive while tasks can still arrive from outside the pool
+    void hold() { pending_.fetch_add(1, std::memory_order_relaxed); }
+    void release() { pending_.fetch_sub(1, std::memory_order_acq_rel); }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mu;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(int w, Task &out) {
+        Queue &q = queues_[w];
+        std::lock_guard<std::mutex> lk(q.mu);
+        if (q.tasks.empty()) return false;
+        out = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    // Victims are tried from a random start so thieves don't all converge on worker 0
+    bool steal(int w, std::mt19937 &pick, Task &out) {
+        int n = workers();
+        int start = (int)(pick() % (unsigned)n);
+        for (int k = 0; k < n; ++k) {
+            int v = (start + k) % n;
+            if (v == w) continue;
+            Queue &q = queues_[v];
+            std::lock_guard<std::mutex> lk(q.mu);
+            if (q.tasks.empty()) continue;
+            out = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void work(int w) {
+        std::mt19937 pick((unsigned)w * 7919u + 1u);
+        WorkerStats &st = stats_[w];
+        Task t;
+        int idle = 0;
+        // A running task counts as pending, so follow-ups it spawns keep everyone alive
+        while (pending_.load(std::memory_order_acquire) > 0) {
+            if (!pop(w, t)) {
+                if (!steal(w, pick, t)) {
+                    // Open-loop gaps between arrivals can be long; back off rather than spin
+                    if (++idle < 64) std::this_thread::yield();
+                    else std::this_thread::sleep_for(std::chrono::microseconds(50));
+                    continue;
+                }
+                ++st.steals;
+            }
+            idle = 0;
+            auto t0 = std::chrono::steady_clock::now();
+            t(w);
+            st.busy_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            ++st.tasks;
+            t = nullptr;
+            pending_.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<WorkerStats> stats_;
+    std::atomic<long long> pending_{0};
+};
+
+double busy_imbalance(const std::vector<StealPool::WorkerStats> &stats) {
+    double sum = 0.0, mx = 0.0;
+    for (const auto &st : stats) {
+        sum += st.busy_s;
+        mx = std::max(mx, st.busy_s);
+    }
+    return sum > 0 ? mx * stats.size() / sum : 0.0;
+}
+
+// Every request of a node is its own task: the node's first request is seeded on the
+// worker that owns its block of node numbers, and each request pushes the next one.
+// Open loop pushes each node's first task at its arrival instead, round-robin over the
+// workers, so nothing is queued before it arrives and idle workers steal the backlog.
+struct StealNode {
+    NodeMetrics m{};
+    NodeSession session;
+    std::chrono::high_resolution_clock::time_point t_start;
+    int next = 0;
+
+    explicit StealNode(int idx) : session(idx) { m.node_index = idx; }
+};
+
+class StealRun {
+public:
+    StealRun(const Config &cfg, const Arrivals &arrivals, int workers, std::vector<NodeMetrics> &results)
+        : cfg_(cfg), arrivals_(arrivals), pool_(workers), dists_(cfg), results_(results) {}
+    // arrivals_ is a reference: a temporary would be gone before run()
+    StealRun(const Config &, Arrivals &&, int, std::vector<NodeMetrics> &) = delete;
+
+    // Returns the per-worker stats once every session has finished
+    const std::vector<StealPool::WorkerStats> &run() {
+        int workers = pool_.workers();
+        if (arrivals_.open()) {
+            pool_.hold();
+            std::thread dispatcher([&] {
+                dispatch_arrivals(arrivals_, [&](int idx) {
+                    pool_.push(idx % workers, [this, idx](int worker) {
+                        auto n = std::make_shared<StealNode>(idx);
+                        n->m.queue_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - arrivals_.intended(idx)).count();
+                        n->t_start = std::chrono::high_resolution_clock::now();
+                        step(std::move(n), worker);
+                    });
+                });
+                pool_.release();
+            });
+            pool_.run();
+            dispatcher.join();
+            return pool_.stats();
+        }
+        for (int w = 0; w < workers; ++w) {
+            int first = (int)((long long)cfg_.nodes * w / workers);
+            int last = (int)((long long)cfg_.nodes * (w + 1) / workers);
+            // Pushed in reverse so the owner's LIFO pops walk its block in node order
+            for (int idx = last - 1; idx >= first; --idx) {
+                pool_.push(w, [this, idx](int worker) {
+                    auto n = std::make_shared<StealNode>(idx);
+                    n->t_start = std::chrono::high_resolution_clock::now();
+                    step(std::move(n), worker);
+                });
+            }
+        }
+        pool_.run();
+        return pool_.stats();
+    }
+
+private:
+    void step(std::shared_ptr<StealNode> n, int w) {
+        thread_request(cfg_, dists_, n->session, n->m, n->next++);
+        if (n->next < cfg_.requests_per_node) {
+            pool_.push(w, [this, n](int worker) { step(n, worker); });
+            return;
+        }
+        n->m.total_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - n->t_start).count() + n->m.queue_us;
+        n->m.phase_ns[PhaseQueue] += n->m.queue_us * 1000;
+        node_done(results_, n->m);
+    }
+
+    const Config &cfg_;
+    const Arrivals &arrivals_;
+    StealPool pool_;
+    NodeDistributions dists_;
+    std::vector<NodeMetrics> &results_;
+};
+
+// ---------- Staged pipeline (--engine pipeline) ----------
+// TA issuance, node processing and middleware validation run as separate stages, each
+// with its own threads (--ta-workers, --workers, --mw-workers), joined by bounded
+// lock-free MPMC queues. A request hops node -> TA (only when it needs a token) ->
+// node -> MW and, if the session has more requests, back to the node stage. Network
+// delays are slept by node threads and the DB delay by MW threads, like the threads
+// engine. The node's wire encryption runs in the MW stage together with the decrypt,
+// since both share one arena scope in node_send_and_mw_validate.
+
+// Vyukov's bounded MPMC ring: each cell's sequence number says whether it is free for
+// the producer at that position or full for the consumer, so push and pop are one CAS.
+template <typename T>
+class MpmcQueue {
+public:
+    explicit MpmcQueue(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        mask_ = n - 1;
+        cells_ = std::vector<Cell>(n);
+        for (size_t i = 0; i < n; ++i) cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T v) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &c = cells_[pos & mask_];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = std::move(v);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;   // full
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &out) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &c = cells_[pos & mask_];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(c.value);
+                    c.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;   // empty
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Racy snapshot for the depth sampler
+    size_t size_approx() const {
+        size_t tail = tail_.load(std::memory_order_relaxed), head = head_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq{0};
+        T value{};
+    };
+
+    std::vector<Cell> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+struct StageSummary {
+    string name;
+    int workers = 0;
+    long long items = 0;
+    double utilization = 0.0;   // busy time / (workers x wall time)
+    double avg_wait_us = 0.0;   // queued before a stage thread picked the request up
+    long long max_wait_us = 0;
+    double avg_depth = 0.0;     // sampled every PIPELINE_SAMPLE_MS
+    size_t max_depth = 0;
+};
+
+constexpr int PIPELINE_SAMPLE_MS = 10;
+
+// One node session moving through the stages; only the stage holding it touches it
+struct PipeItem {
+    enum class Phase { Start, Send };
+    Phase phase = Phase::Start;     // node stage: start the next request, or send it once the token is in
+    NodeMetrics m{};
+    NodeSession session;
+    NodeDraws d;
+    NodeRequest req;
+    bool fetch = false;
+    bool picked = false;            // first node-stage pickup seen
+    int next = 0;
+    std::chrono::steady_clock::time_point t_start, enqueued;
+
+    explicit PipeItem(int idx) : session(idx) { m.node_index = idx; }
+};
+
+class PipelineRun {
+public:
+    struct DepthSample {
+        double t_ms;
+        size_t depth[3];    // ta, node, mw
+    };
+
+    PipelineRun(const Config &cfg, const Arrivals &arrivals, std::vector<NodeMetrics> &results)
+        : cfg_(cfg), arrivals_(arrivals), results_(results),
+          // Closed loop keeps every stage thread fed; open loop admits every arrival
+          inflight_(cfg.inflight > 0 ? std::min(cfg.inflight, cfg.nodes)
+                    : arrivals.open() ? cfg.nodes : std::min(cfg.nodes, cfg.ta_workers + cfg.workers + cfg.mw_workers)),
+          // A queue never holds more than the sessions in flight, so pushes can't block
+          ta_("ta", inflight_, cfg.ta_workers), node_("node", inflight_, cfg.workers), mw_("mw", inflight_, cfg.mw_workers), dists_(cfg) {}
+    // arrivals_ is a reference: a temporary would be gone before run()
+    PipelineRun(const Config &, Arrivals &&, std::vector<NodeMetrics> &) = delete;
+
+    void run() {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int w = 0; w < (int)ta_.stats.size(); ++w) threads.emplace_back([this, w] { serve(ta_, w, [this](PipeItem *it, int) { ta_step(it); }); });
+        for (int w = 0; w < (int)node_.stats.size(); ++w) threads.emplace_back([this, w] { serve(node_, w, [this](PipeItem *it, int) { node_step(it); }); });
+        for (int w = 0; w < (int)mw_.stats.size(); ++w) threads.emplace_back([this, w] { serve(mw_, w, [this](PipeItem *it, int) { mw_step(it); }); });
+        std::thread sampler([this, t0] {
+            while (!done_.load(std::memory_order_acquire)) {
+                double t_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                samples_.push_back({t_ms, {ta_.queue.size_approx(), node_.queue.size_approx(), mw_.queue.size_approx()}});
+                std::this_thread::sleep_for(std::chrono::milliseconds(PIPELINE_SAMPLE_MS));
+            }
+        });
+
+        if (arrivals_.open()) {
+            dispatch_arrivals(arrivals_, [this](int idx) {
+                // Late admissions still count from the intended start
+                while (active_.load(std::memory_order_acquire) >= inflight_) std::this_thread::sleep_for(std::chrono::microseconds(50));
+                active_.fetch_add(1, std::memory_order_acq_rel);
+                admit(idx);
+            });
+        } else {
+            for (int i = 0; i < inflight_; ++i) admit(next_idx_.fetch_add(1));
+        }
+
+        for (auto &t : threads) t.join();
+        sampler.join();
+        wall_s_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    std::vector<StageSummary> summaries() const {
+        std::vector<StageSummary> out;
+        int k = 0;
+        for (const Stage *s : {&ta_, &node_, &mw_}) {
+            StageSummary ss;
+            ss.name = s->name;
+            ss.workers = (int)s->stats.size();
+            double busy = 0.0, wait = 0.0;
+            for (const auto &st : s->stats) {
+                ss.items += st.items;
+                busy += st.busy_s;
+                wait += st.wait_us;
+                ss.max_wait_us = std::max(ss.max_wait_us, st.max_wait_us);
+            }
+            if (wall_s_ > 0 && ss.workers > 0) ss.utilization = busy / (ss.workers * wall_s_);
+            if (ss.items > 0) ss.avg_wait_us = wait / ss.items;
+            double depth = 0.0;
+            for (const auto &d : samples_) {
+                depth += d.depth[k];
+                ss.max_depth = std::max(ss.max_depth, d.depth[k]);
+            }
+            if (!samples_.empty()) ss.avg_depth = depth / samples_.size();
+            out.push_back(ss);
+            ++k;
+        }
+        return out;
+    }
+
+    void write_depth_csv(const string &filename) const {
+        std::ofstream fout(filename);
+        if (!fout.good()) return;
+        fout << "t_ms,ta_depth,node_depth,mw_depth\n";
+        for (const auto &d : samples_) fout << std::fixed << std::setprecision(1) << d.t_ms << "," << d.depth[0] << "," << d.depth[1] << "," << d.depth[2] << "\n";
+    }
+
+private:
+    struct alignas(64) WorkerStats {
+        long long items = 0;
+        double busy_s = 0.0;
+        double wait_us = 0.0;
+        long long max_wait_us = 0;
+    };
+
+    struct Stage {
+        const char *name;
+        MpmcQueue<PipeItem*> queue;
+        std::vector<WorkerStats> stats;
+
+        Stage(const char *n, int capacity, int workers) : name(n), queue((size_t)capacity), stats(workers) {}
+    };
+
+    // Once published another thread may own and free the item, so every write to it comes first
+    void push(Stage &s, PipeItem *it, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        it->enqueued = now;
+        while (!s.queue.try_push(it)) std::this_thread::yield();
+    }
+
+    template <typename F>
+    void serve(Stage &s, int w, F &&step) {
+        WorkerStats &st = s.stats[w];
+        PipeItem *it = nullptr;
+        int idle = 0;
+        while (true) {
+            if (!s.queue.try_pop(it)) {
+                if (done_.load(std::memory_order_acquire)) return;
+                if (++idle < 64) std::this_thread::yield();
+                else std::this_thread::sleep_for(std::chrono::microseconds(50));
+                continue;
+            }
+            idle = 0;
+            auto t0 = std::chrono::steady_clock::now();
+            long long wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t0 - it->enqueued).count();
+            long long wait = wait_ns / 1000;
+            it->m.phase_ns[PhaseQueue] += wait_ns;
+            st.wait_us += wait;
+            st.max_wait_us = std::max(st.max_wait_us, wait);
+            ++st.items;
+            step(it, w);
+            st.busy_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        }
+    }
+
+    void admit(int idx) {
+        if (idx >= cfg_.nodes) return;
+        auto *it = new PipeItem(idx);
+        auto now = std::chrono::steady_clock::now();
+        it->t_start = arrivals_.open() ? arrivals_.intended(idx) : now;
+        // Open loop: admitted late when the in-flight cap was reached; the node-queue wait is added on pickup
+        it->m.phase_ns[PhaseQueue] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - it->t_start).count();
+        push(node_, it, now);
+    }
+
+    // Node stage, Start: draw the next request and route it; dropped requests settle here
+    void node_step(PipeItem *it) {
+        if (!it->picked) {
+            it->picked = true;
+            if (arrivals_.open())
+                it->m.queue_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - it->t_start).count();
+        }
+        if (it->phase == PipeItem::Phase::Send) {
+            node_send(it);
+            return;
+        }
+        while (it->next < cfg_.requests_per_node) {
+            int r = it->next++;
+            it->d = dists_.draw(it->m.node_index, r);
+            if (r == 0) sleep_phase(it->m, PhaseJitter, it->d.jitter_ms);
+            it->fetch = it->session.needs_token(protocol_now_ms());
+            ++it->m.requests;
+            if (it->d.dropped) {
+                if (it->fetch) sleep_phase(it->m, PhaseTaNet, it->d.net_ta_node_ms);
+                ++it->m.drops;
+                continue;
+            }
+            if (it->fetch) {
+                push(ta_, it);
+                return;
+            }
+            node_send(it);
+            return;
+        }
+        finish(it);
+    }
+
+    void ta_step(PipeItem *it) {
+        it->m.allocs += count_allocs([&] {
+            timed_phase(it->m, PhaseTaIssue, [&] { TA_issue_tokens_into((uint32_t)it->session.idx, it->session.issued); });
+        });
+        it->phase = PipeItem::Phase::Send;
+        push(node_, it);
+    }
+
+    // Node stage, Send: pick up the token if one was issued, build the request and put it on the wire
+    void node_send(PipeItem *it) {
+        it->phase = PipeItem::Phase::Start;
+        if (it->fetch) sleep_phase(it->m, PhaseTaNet, it->d.net_ta_node_ms);
+        it->m.allocs += count_allocs([&] {
+            if (it->fetch) {
+                timed_phase(it->m, PhaseTokenOpen, [&] { it->m.wire_bytes += (long long)node_open_token(it->session); });
+                ++it->m.ta_issues;
+            }
+            timed_phase(it->m, PhaseBuild, [&] { it->req = node_build_request(it->session, cfg_, it->d.tampered); });
+        });
+        sleep_phase(it->m, PhaseMwNet, it->d.net_node_mw_ms);
+        push(mw_, it);
+    }
+
+    void mw_step(PipeItem *it) {
+        node_send_recorded(it->m, it->req);
+        sleep_phase(it->m, PhaseDb, it->d.db_delay_ms);
+        if (it->next < cfg_.requests_per_node) push(node_, it);
+        else finish(it);
+    }
+
+    void finish(PipeItem *it) {
+        std::unique_ptr<PipeItem> owned(it);
+        owned->m.total_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - owned->t_start).count();
+        node_done(results_, owned->m);
+        if (arrivals_.open()) active_.fetch_sub(1, std::memory_order_acq_rel);
+        else admit(next_idx_.fetch_add(1));
+        if (finished_.fetch_add(1, std::memory_order_acq_rel) + 1 == cfg_.nodes) done_.store(true, std::memory_order_release);
+    }
+
+    const Config &cfg_;
+    const Arrivals &arrivals_;
+    std::vector<NodeMetrics> &results_;
+    int inflight_;
+    Stage ta_, node_, mw_;
+    NodeDistributions dists_;
+    std::vector<DepthSample> samples_;
+    std::atomic<int> next_idx_{0}, active_{0}, finished_{0};
+    std::atomic<bool> done_{false};
+    double wall_s_ = 0.0;
+};
+
+// ---------- Discrete-event engine (virtual clock) ----------
+// Delays advance a virtual clock instead of sleeping. Crypto work still runs for
+// real; its measured duration is charged to the virtual clock as service time.
+class EventQueue {
+public:
+    long long now_ns() const { return now_ns_; }
+
+    void schedule(long long delay_ns, std::function<void()> fn) {
+        queue_.push(Event{now_ns_ + delay_ns, seq_++, std::move(fn)});
+    }
+
+    void run() {
+        while (!queue_.empty()) {
+            Event ev = queue_.top();
+            queue_.pop();
+            now_ns_ = ev.at_ns;
+            ev.fn();
+        }
+    }
+
+private:
+    struct Event {
+        long long at_ns;
+        unsigned long long seq;     // FIFO among events at the same instant
+        std::function<void()> fn;
+        bool operator>(const Event &o) const {
+            return at_ns != o.at_ns ? at_ns > o.at_ns : seq > o.seq;
+        }
+    };
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> queue_;
+    long long now_ns_ = 0;
+    unsigned long long seq_ = 0;
+};
+
+constexpr long long NS_PER_MS = 1000000LL;
+
+// Runs all nodes on cfg.workers virtual workers; returns simulated run time in seconds.
+// Token issue times and expiry checks follow the virtual clock while it runs.
+// Open loop: each node arrives as an event and waits in FIFO order for a free worker.
+double run_des(const Config &cfg, const Arrivals &arrivals, int workers, std::vector<NodeMetrics> &results) {
+    EventQueue eq;
+    NodeDistributions dists(cfg);
+    int next_idx = 0;
+    const long long epoch_ms = unix_ms();
+    auto sync_clock = [&] { g_virtual_now_ms = epoch_ms + eq.now_ns() / NS_PER_MS; };
+    long long end_ns = 0;
+
+    struct DesNode {
+        NodeSession session;
+        NodeMetrics m{};
+        long long t_start_ns;       // intended start under open loop
+    };
+
+    std::deque<int> waiting;        // open loop: arrived, no free worker yet
+    int busy = 0, finished = 0;
+    std::function<void()> start_next;
+    std::function<void(std::shared_ptr<DesNode>)> next_request = [&](std::shared_ptr<DesNode> n) {
+        if (n->m.requests == cfg.requests_per_node) {
+            n->m.total_us = (eq.now_ns() - n->t_start_ns) / 1000;
+            n->m.phase_ns[PhaseQueue] += n->m.queue_us * 1000;
+            node_done(results, n->m);
+            ++finished;
+            end_ns = eq.now_ns();
+            --busy;
+            start_next();
+            return;
         }
-        else if (a=="--fail-percent" && i+1<argc) { cfg.fail_percent = std::stod(argv[++i]); }
-        else if (a=="--out" && i+1<argc) { cfg.out_file = argv[++i]; }
-        else if (a=="--help" || a=="-h") {
-            return false;
+        NodeDraws d = dists.draw(n->m.node_index, n->m.requests);
+        long long start_delay = (n->m.requests == 0) ? d.jitter_ms * NS_PER_MS : 0;
+        n->m.phase_ns[PhaseJitter] += start_delay;
+
+        eq.schedule(start_delay, [&, n, d]() {
+            sync_clock();
+            bool fetch = n->session.needs_token(protocol_now_ms());
+            if (fetch) n->m.phase_ns[PhaseTaNet] += d.net_ta_node_ms * NS_PER_MS;
+
+            eq.schedule(fetch ? d.net_ta_node_ms * NS_PER_MS : 0, [&, n, d, fetch]() {
+                ++n->m.requests;
+                if (d.dropped) {
+                    ++n->m.drops;
+                    next_request(n);
+                    return;
+                }
+
+                sync_clock();
+                auto req = std::make_shared<NodeRequest>();
+                long long cpu_ns = node_prepare_request(n->m, n->session, cfg, fetch, d.tampered, *req);
+                n->m.phase_ns[PhaseMwNet] += d.net_node_mw_ms * NS_PER_MS;
+
+                eq.schedule(cpu_ns + d.net_node_mw_ms * NS_PER_MS, [&, n, d, req]() {
+                    sync_clock();
+                    long long cpu2_ns = node_send_recorded(n->m, *req);
+                    n->m.phase_ns[PhaseDb] += d.db_delay_ms * NS_PER_MS;
+                    eq.schedule(cpu2_ns + d.db_delay_ms * NS_PER_MS, [&, n]() { next_request(n); });
+                });
+            });
+        });
+    };
+
+    start_next = [&]() {
+        int idx;
+        long long t_start_ns = eq.now_ns();
+        if (arrivals.open()) {
+            if (waiting.empty()) return;
+            idx = waiting.front();
+            waiting.pop_front();
+            t_start_ns = arrivals.at_ns[idx];
         } else {
-            cerr << "Unknown arg: " << a << "\n";
-            return false;
+            if (next_idx >= cfg.nodes) return;
+            idx = next_idx++;
         }
+        ++busy;
+        auto n = std::make_shared<DesNode>(DesNode{NodeSession(idx), NodeMetrics{}, t_start_ns});
+        n->m.node_index = idx;
+        n->m.queue_us = (eq.now_ns() - t_start_ns) / 1000;
+        next_request(n);
+    };
+
+    // Key rotation on the virtual clock; the rebuild runs off the simulated workers
+    std::function<void()> rotate_tick = [&]() {
+        if (finished == cfg.nodes) return;
+        rotate_keys();
+        eq.schedule(cfg.rotate_every_ms * NS_PER_MS, rotate_tick);
+    };
+    if (cfg.rotate_every_ms > 0) eq.schedule(cfg.rotate_every_ms * NS_PER_MS, rotate_tick);
+
+    if (arrivals.open()) {
+        for (int i = 0; i < cfg.nodes; ++i) {
+            eq.schedule(arrivals.at_ns[i], [&, i]() {
+                waiting.push_back(i);
+                if (busy < workers) start_next();
+            });
+        }
+    } else {
+        for (int w = 0; w < workers; ++w) start_next();
     }
-    if (cfg.nodes <= 0) cfg.nodes = 1000;
-    if (cfg.workers <= 0) cfg.workers = 1;
-    if (cfg.tamper_percent < 0) cfg.tamper_percent = 0;
-    if (cfg.tamper_percent > 100) cfg.tamper_percent = 100;
-    if (cfg.fail_percent < 0) cfg.fail_percent = 0;
-    if (cfg.fail_percent > 100) cfg.fail_percent = 100;
-    return true;
+    eq.run();
+    g_virtual_now_ms = -1;
+    return end_ns / 1e9;
 }
 
-void print_usage(const char* prog) {
-    cout << "Usage: " << prog << " [--nodes N] [--workers N] [--tamper-percent P] [--payload-bytes N]\n";
-    cout << "       [--node-jitter MS] [--net-ta-node MIN MAX] [--net-node-mw MIN MAX] [--db-delay MIN MAX]\n";
-    cout << "       [--fail-percent P] [--out filename]\n";
-    cout << "Defaults: nodes=1000 workers=4 tamper-percent=0.0 payload-bytes=256 fail-percent=1.0\n";
-    cout << "Example: " << prog << " --nodes 1000 --workers 4 --tamper-percent 5 --payload-bytes 512 --fail-percent 2\n";
-}
+// ---------- Coroutine engine (timer wheel + ready queue) ----------
+// Each node is a coroutine. Delays suspend it on a shared timer wheel instead of
+// blocking a thread, so worker threads only spend time on crypto and parsing and
+// concurrency is set by --inflight rather than --workers.
+class ReadyQueue {
+public:
+    void push(std::coroutine_handle<> h) {
+        {
+            std::lock_guard<std::mutex> lg(mu_);
+            items_.push_back(h);
+        }
+        cv_.notify_one();
+    }
 
-// ---------- Metrics ----------
-struct NodeMetrics {
-    int node_index;
-    long long total_us = 0;
-    bool success = false;
-    bool dropped = false;
+    // Blocks until a handle is available; returns false once closed and drained.
+    bool pop(std::coroutine_handle<> &h) {
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        h = items_.front();
+        items_.pop_front();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lg(mu_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::coroutine_handle<>> items_;
+    bool closed_ = false;
 };
 
-long long median_of_vec(std::vector<long long> v) {
-    if (v.empty()) return 0;
-    std::sort(v.begin(), v.end());
-    size_t n = v.size();
-    return (n % 2 == 1) ? v[n/2] : ((v[n/2 - 1] + v[n/2]) / 2);
-}
+// Hashed timer wheel with 1 ms ticks. Entries further out than one revolution
+// stay in their slot until their due tick comes round.
+class TimerWheel {
+public:
+    explicit TimerWheel(ReadyQueue &ready, size_t slots = 1024) : ready_(ready), slots_(slots) {}
 
-// ---------- Worker ----------
-void worker_func(std::atomic<int> &counter, const Config &cfg, std::vector<NodeMetrics> &results, std::mutex &res_mutex, std::mt19937 &rng) {
-    std::uniform_int_distribution<int> jitter(0, cfg.node_start_jitter_ms);
-    std::uniform_int_distribution<int> net_ta_node(cfg.net_delay_ta_node_min, cfg.net_delay_ta_node_max);
-    std::uniform_int_distribution<int> net_node_mw(cfg.net_delay_node_mw_min, cfg.net_delay_node_mw_max);
-    std::uniform_int_distribution<int> db_delay(cfg.db_delay_min, cfg.db_delay_max);
-    std::uniform_real_distribution<double> tamper_unif(0.0, 1.0);
-    std::uniform_real_distribution<double> fail_unif(0.0, 1.0);
+    void add(int delay_ms, std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> lg(mu_);
+        unsigned long long due = tick_ + (unsigned long long)std::max(delay_ms, 1);
+        slots_[due % slots_.size()].push_back({due, h});
+    }
 
-    while (true) {
-        int idx = counter.fetch_add(1);
-        if (idx >= cfg.nodes) break;
-        NodeMetrics m{};
-        m.node_index = idx;
-        using clk = std::chrono::high_resolution_clock;
-        auto t_start = clk::now();
+    void run(const std::atomic<bool> &stop) {
+        auto next = std::chrono::steady_clock::now();
+        std::vector<std::coroutine_handle<>> fired;
+        while (!stop.load(std::memory_order_acquire)) {
+            next += std::chrono::milliseconds(1);
+            std::this_thread::sleep_until(next);
+            {
+                std::lock_guard<std::mutex> lg(mu_);
+                ++tick_;
+                auto &slot = slots_[tick_ % slots_.size()];
+                auto keep = std::partition(slot.begin(), slot.end(), [&](const Entry &e) { return e.due > tick_; });
+                for (auto it = keep; it != slot.end(); ++it) fired.push_back(it->h);
+                slot.erase(keep, slot.end());
+            }
+            for (auto h : fired) ready_.push(h);
+            fired.clear();
+        }
+    }
+
+private:
+    struct Entry {
+        unsigned long long due;
+        std::coroutine_handle<> h;
+    };
+    ReadyQueue &ready_;
+    std::mutex mu_;
+    std::vector<std::vector<Entry>> slots_;
+    unsigned long long tick_ = 0;
+};
 
-        // Staggered node start
-        std::this_thread::sleep_for(std::chrono::milliseconds(jitter(rng)));
+struct SleepAwaiter {
+    TimerWheel &wheel;
+    int ms;
+    bool await_ready() const noexcept { return ms <= 0; }
+    void await_suspend(std::coroutine_handle<> h) { wheel.add(ms, h); }
+    void await_resume() const noexcept {}
+};
 
-        // Simulate network delay TA -> Node
-        std::this_thread::sleep_for(std::chrono::milliseconds(net_ta_node(rng)));
+// Fire-and-forget coroutine: starts suspended so the caller can hand it to the
+// ready queue, and frees its own frame when it finishes.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
 
-        // Simulate random drop/failure
-        if (fail_unif(rng) < (cfg.fail_percent / 100.0)) {
-            m.dropped = true;
-            auto t_end = clk::now();
-            m.total_us = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count();
-            std::lock_guard<std::mutex> lg(res_mutex);
-            results.push_back(std::move(m));
-            continue;
-        }
+struct CoroRun {
+    const Config &cfg;
+    const Arrivals &arrivals;
+    std::vector<NodeMetrics> &results;
+    ReadyQueue ready;
+    TimerWheel wheel{ready};
+    std::atomic<bool> stop{false};
+    std::atomic<int> next_idx{0};
+    std::atomic<int> done{0};
+    NodeDistributions dists;
+    // Open loop: arrived nodes past the --inflight cap wait here
+    std::mutex admit_mutex;
+    std::deque<int> waiting;
+    int active = 0, limit = 0;
+
+    CoroRun(const Config &c, const Arrivals &a, std::vector<NodeMetrics> &r)
+        : cfg(c), arrivals(a), results(r), dists(c) {}
 
-        // TA issues token
-        IssuedTokens issued = TA_issue_tokens_for_node(NODE_ID_BASE + std::to_string(idx));
+    SleepAwaiter sleep(int ms) { return {wheel, ms}; }
+    void spawn_next();
+    void arrive(int idx);
+    void node_finished(NodeMetrics m);
+};
 
-        // Node decrypts
-        string decrypted_payload = aesDecryptHex(KEY_TA_NODE, issued.enc_for_node);
-        auto p_token = decrypted_payload.find("TOKEN:");
-        string token_extracted = (p_token != string::npos) ? decrypted_payload.substr(p_token + 6) : "";
+DetachedTask node_coro(CoroRun &run, int idx) {
+    NodeMetrics m{};
+    m.node_index = idx;
+    // First resumed once admitted and picked off the ready queue; any wait since arrival counts
+    if (run.arrivals.open())
+        m.queue_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - run.arrivals.intended(idx)).count();
+    NodeSession session(idx);
+    using clk = std::chrono::high_resolution_clock;
+    auto t_start = clk::now();
 
-        // Maybe tamper
-        if (tamper_unif(rng) < (cfg.tamper_percent / 100.0)) {
-            token_extracted = genTokenHex(8);
+    for (int r = 0; r < run.cfg.requests_per_node; ++r) {
+        NodeDraws d = run.dists.draw(idx, r);
+        // A wait runs until the coroutine is resumed, ready-queue time included
+        auto t_wait = std::chrono::steady_clock::now();
+        auto waited = [&](Phase p) {
+            auto now = std::chrono::steady_clock::now();
+            m.phase_ns[p] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - t_wait).count();
+            t_wait = now;
+        };
+        if (r == 0) {
+            co_await run.sleep(d.jitter_ms);
+            waited(PhaseJitter);
         }
 
-        // Build and encrypt to MW
-        string payload(cfg.payload_bytes, 'A' + (idx % 26));
-        string header = "NODE_ID:" + NODE_ID_BASE + std::to_string(idx) + ";TOKEN:" + token_extracted;
-        string full_request = "HEADER[" + header + "]|BODY[" + payload + "]";
+        bool fetch = session.needs_token(protocol_now_ms());
+        if (fetch) {
+            t_wait = std::chrono::steady_clock::now();
+            co_await run.sleep(d.net_ta_node_ms);
+            waited(PhaseTaNet);
+        }
 
-        // Simulate network delay Node -> MW
-        std::this_thread::sleep_for(std::chrono::milliseconds(net_node_mw(rng)));
+        ++m.requests;
+        if (d.dropped) {
+            ++m.drops;
+            continue;
+        }
+        NodeRequest req;
+        node_prepare_request(m, session, run.cfg, fetch, d.tampered, req);
+        t_wait = std::chrono::steady_clock::now();
+        co_await run.sleep(d.net_node_mw_ms);
+        waited(PhaseMwNet);
+        node_send_recorded(m, req);
+        t_wait = std::chrono::steady_clock::now();
+        co_await run.sleep(d.db_delay_ms);
+        waited(PhaseDb);
+    }
 
-        string encrypted_for_mw = aesEncryptHex(KEY_NODE_MW, full_request);
+    m.total_us = std::chrono::duration_cast<std::chrono::microseconds>(clk::now() - t_start).count() + m.queue_us;
+    m.phase_ns[PhaseQueue] += m.queue_us * 1000;
+    run.node_finished(std::move(m));
+}
 
-        // Middleware decrypt & validate
-        string ta_payload_for_mw = aesDecryptHex(KEY_TA_MW, issued.enc_for_mw);
-        string ta_token;
-        auto p = ta_payload_for_mw.find("TOKEN:");
-        if (p != string::npos) ta_token = ta_payload_for_mw.substr(p + 6);
+void CoroRun::spawn_next() {
+    int idx = next_idx.fetch_add(1);
+    if (idx >= cfg.nodes) return;
+    ready.push(node_coro(*this, idx).handle);
+}
 
-        string node_request_plain = aesDecryptHex(KEY_NODE_MW, encrypted_for_mw);
+void CoroRun::arrive(int idx) {
+    {
+        std::lock_guard<std::mutex> lg(admit_mutex);
+        if (active >= limit) {
+            waiting.push_back(idx);
+            return;
+        }
+        ++active;
+    }
+    ready.push(node_coro(*this, idx).handle);
+}
 
-        // parse header token
-        string header_marker = "HEADER[";
-        auto hpos = node_request_plain.find(header_marker);
-        if (hpos != string::npos) {
-            auto hend = node_request_plain.find("]", hpos + header_marker.size());
-            if (hend != string::npos) {
-                string header_str = node_request_plain.substr(hpos + header_marker.size(), hend - (hpos + header_marker.size()));
-                auto tpos = header_str.find("TOKEN:");
-                string node_token = (tpos != string::npos) ? header_str.substr(tpos + 6) : "";
-                m.success = (node_token == ta_token);
+void CoroRun::node_finished(NodeMetrics m) {
+    node_done(results, m);
+    if (arrivals.open()) {
+        // Open loop: the freed slot goes to the oldest waiting arrival, if any
+        int idx = -1;
+        {
+            std::lock_guard<std::mutex> lg(admit_mutex);
+            if (waiting.empty()) {
+                --active;
+            } else {
+                idx = waiting.front();
+                waiting.pop_front();
             }
         }
+        if (idx >= 0) ready.push(node_coro(*this, idx).handle);
+    } else {
+        // Closed loop: each completion admits the next node
+        spawn_next();
+    }
+    if (done.fetch_add(1) + 1 == cfg.nodes) {
+        stop.store(true, std::memory_order_release);
+        ready.close();
+    }
+}
 
-        // Simulate DB write delay
-        std::this_thread::sleep_for(std::chrono::milliseconds(db_delay(rng)));
-
-        auto t_end = clk::now();
-        m.total_us = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count();
+void run_coro(const Config &cfg, const Arrivals &arrivals, int workers, std::vector<NodeMetrics> &results) {
+    CoroRun run(cfg, arrivals, results);
+    int inflight = (cfg.inflight > 0) ? std::min(cfg.inflight, cfg.nodes) : cfg.nodes;
+    std::thread dispatcher;
+    if (arrivals.open()) {
+        run.limit = inflight;
+        dispatcher = std::thread([&] { dispatch_arrivals(arrivals, [&](int idx) { run.arrive(idx); }); });
+    } else {
+        for (int i = 0; i < inflight; ++i) run.spawn_next();
+    }
 
-        std::lock_guard<std::mutex> lg(res_mutex);
-        results.push_back(std::move(m));
+    std::thread timer([&] { run.wheel.run(run.stop); });
+    std::vector<std::thread> pool;
+    pool.reserve(workers);
+    for (int i = 0; i < workers; ++i) {
+        pool.emplace_back([&] {
+            std::coroutine_handle<> h;
+            while (run.ready.pop(h)) h.resume();
+        });
     }
+    for (auto &t : pool) t.join();
+    timer.join();
+    if (dispatcher.joinable()) dispatcher.join();
 }
 
 // ---------- CSV + summary helpers ----------
@@ -292,46 +3706,1175 @@ std::string currentTimestamp() {
     return oss.str();
 }
 
-void append_perf_csv(int nodes, int workers, long long avg_us, long long min_us, long long max_us, long long med_us, double success_pct, double drop_pct, double wall_time_s, const string &filename) {
+// One row per node, one column per phase (us); "other" is the rest of the session time
+void write_phase_csv(const std::vector<NodeMetrics> &results, const string &filename) {
+    std::ofstream f(filename);
+    if (!f.good()) {
+        cerr << "Failed to open phase CSV file: " << filename << "\n";
+        return;
+    }
+    f << "node,requests,total_us";
+    for (const char *name : PHASE_NAMES) f << "," << name << "_us";
+    f << ",other_us\n";
+    f << std::fixed << std::setprecision(1);
+    for (const auto &m : results) {
+        f << m.node_index << "," << m.requests << "," << m.total_us;
+        for (long long ns : m.phase_ns) f << "," << ns / 1000.0;
+        f << "," << other_phase_ns(m) / 1000.0 << "\n";
+    }
+}
+// Aggregates over all nodes of one run
+// Per-node session time in one phase; index PHASE_COUNT is "other"
+struct PhaseSummary {
+    double mean_us = 0.0;
+    double p50_us = 0.0, p99_us = 0.0;
+};
+
+struct RunSummary {
+    long long avg_us = 0, min_us = 0, max_us = 0, med_us = 0;   // per node session
+    long long avg_request_us = 0;     // session time amortized over its requests
+    long long p90_us = 0, p99_us = 0, p999_us = 0, p9999_us = 0;
+    std::vector<std::pair<double, long long>> distribution;   // (quantile, us) for the percentile dump
+    long long latency_count = 0;      // node sessions behind the quantiles
+    string quantile_method;           // "hdr histogram" or "ddsketch"
+    double quantile_error = 0.0;      // relative error bound of every quantile above
+    size_t quantile_bins = 0;         // ddsketch only: bins held by the merged sketch
+    long long avg_queue_us = 0;       // open loop: arrival to first step, already inside the node times
+    long long requests = 0, ta_issues = 0;
+    double success_pct = 0.0, drop_pct = 0.0;                   // per request
+    double avg_wire_bytes = 0.0;      // per request
+    double allocs_per_request = 0.0;  // protocol steps only, per delivered request
+    long long max_request_buffer_bytes = 0;
+    long long steals = 0;             // threads engine, steal scheduler; filled in by main
+    double busy_imbalance = 0.0;      // max / mean worker busy time (0 = not measured)
+    std::vector<StageSummary> stages; // pipeline engine only; filled in by main
+    PhaseSummary phases[PHASE_COUNT + 1];
+    double run_time_s = 0.0;
+    double key_setup_ms = 0.0;        // key directory build, filled in by main
+    size_t key_directory_bytes = 0;
+    int key_rotations = 0;
+    long long stale_epoch_rejects = 0;
+};
+
+void apply_totals(RunSummary &s, const RunTotals &t) {
+    s.requests = t.requests;
+    s.ta_issues = t.ta_issues;
+    s.max_request_buffer_bytes = t.max_buffer_bytes;
+    if (t.sent_requests > 0) s.avg_request_us = t.sent_us / t.sent_requests;
+    if (t.nodes > 0) s.avg_queue_us = t.queue_us / t.nodes;
+    if (t.requests > 0) {
+        s.success_pct = 100.0 * t.successes / (double)t.requests;
+        s.drop_pct = 100.0 * t.drops / (double)t.requests;
+    }
+    long long delivered = t.requests - t.drops;
+    if (delivered > 0) {
+        s.avg_wire_bytes = t.wire_bytes / (double)delivered;
+        s.allocs_per_request = t.allocs / (double)delivered;
+    }
+}
+
+// Node session quantiles from either LatencyHistogram or DDSketch. The distribution
+// ticks halve the remaining tail (0, 25, 50, 62.5, 75, ... %) until it holds less
+// than one sample, then the maximum.
+template <typename Q>
+void apply_quantiles(RunSummary &s, const Q &q) {
+    s.latency_count = q.count();
+    if (q.count() == 0) return;
+    s.avg_us = (long long)q.mean();
+    s.min_us = (long long)q.min();
+    s.max_us = (long long)q.max();
+    s.med_us = (long long)q.value_at(0.50);
+    s.p90_us = (long long)q.value_at(0.90);
+    s.p99_us = (long long)q.value_at(0.99);
+    s.p999_us = (long long)q.value_at(0.999);
+    s.p9999_us = (long long)q.value_at(0.9999);
+    for (double tail = 1.0; tail * q.count() >= 1.0; tail /= 2) {
+        s.distribution.emplace_back(1.0 - tail, (long long)q.value_at(1.0 - tail));
+        s.distribution.emplace_back(1.0 - tail * 0.75, (long long)q.value_at(1.0 - tail * 0.75));
+    }
+    s.distribution.emplace_back(1.0, (long long)q.max());
+}
+
+// Node session percentiles come from latency, which the engines record per thread as nodes finish
+RunSummary summarize(const std::vector<NodeMetrics> &results, double run_time_s, const LatencyHistogram &latency) {
+    RunSummary s;
+    s.run_time_s = run_time_s;
+    RunTotals t;
+    for (const auto &m : results) t.add(m);
+    apply_totals(s, t);
+    apply_quantiles(s, latency);
+    s.quantile_method = "hdr histogram";
+    s.quantile_error = 1.0 / LatencyHistogram::HALF;
+    if (!results.empty()) {
+        std::vector<long long> per_node(results.size());
+        for (int p = 0; p <= PHASE_COUNT; ++p) {
+            for (size_t i = 0; i < results.size(); ++i)
+                per_node[i] = p < PHASE_COUNT ? results[i].phase_ns[p] : other_phase_ns(results[i]);
+            s.phases[p].mean_us = std::accumulate(per_node.begin(), per_node.end(), 0LL) / 1000.0 / per_node.size();
+            s.phases[p].p50_us = percentile_of_vec(per_node, 0.50) / 1000.0;
+            s.phases[p].p99_us = percentile_of_vec(per_node, 0.99) / 1000.0;
+        }
+    }
+    return s;
+}
+
+// Single-threaded callers (the des benches) summarize straight from the results
+RunSummary summarize(const std::vector<NodeMetrics> &results, double run_time_s) {
+    LatencyHistogram latency;
+    for (const auto &m : results)
+        if (m.drops < m.requests) latency.record(m.total_us);
+    return summarize(results, run_time_s, latency);
+}
+
+// --stats stream: the same summary from the merged per-thread sketches
+RunSummary summarize_stream(const StreamStats &st, double run_time_s) {
+    RunSummary s;
+    s.run_time_s = run_time_s;
+    apply_totals(s, st.totals);
+    apply_quantiles(s, st.total_us);
+    s.quantile_method = "ddsketch";
+    s.quantile_error = st.total_us.relative_accuracy();
+    s.quantile_bins = st.total_us.bins();
+    for (int p = 0; p <= PHASE_COUNT; ++p) {
+        s.phases[p].mean_us = st.phase_us[p].mean();
+        s.phases[p].p50_us = st.phase_us[p].value_at(0.50);
+        s.phases[p].p99_us = st.phase_us[p].value_at(0.99);
+    }
+    return s;
+}
+
+const string PERF_CSV_HEADER = "Timestamp,Nodes,Workers,Avg Total (us),Min (us),Max (us),Median (us),P90 (us),P99 (us),P99.9 (us),P99.99 (us),Success %,Dropped %,Wall Time (s)";
+
+// Appends one row. A file whose header is not PERF_CSV_HEADER (an older column layout)
+// is moved aside to <file>.old, <file>.old1, ... and a fresh file is started, so rows
+// never land under the wrong columns.
+void append_perf_csv(int nodes, int workers, const RunSummary &s, const string &filename) {
     bool newFile = false;
     {
         std::ifstream check(filename);
-        newFile = !check.good();
+        string header;
+        newFile = !check.good() || !std::getline(check, header);
+        if (!header.empty() && header.back() == '\r') header.pop_back();
+        if (!newFile && header != PERF_CSV_HEADER) {
+            check.close();
+            string aside = filename + ".old";
+            for (int n = 1; std::ifstream(aside).good(); ++n) aside = filename + ".old" + std::to_string(n);
+            if (std::rename(filename.c_str(), aside.c_str()) != 0) {
+                cerr << "Perf CSV " << filename << " has a different column layout and could not be moved aside; row not written\n";
+                return;
+            }
+            cerr << "Perf CSV " << filename << " had a different column layout; moved it to " << aside << " and started a new file\n";
+            newFile = true;
+        }
     }
     std::ofstream f(filename, std::ios::app);
     if (!f.good()) {
         cerr << "Failed to open perf CSV file: " << filename << "\n";
         return;
     }
-    if (newFile) {
-        f << "Timestamp,Nodes,Workers,Avg Total (us),Min (us),Max (us),Median (us),Success %,Dropped %,Wall Time (s)\n";
-    }
-    f << currentTimestamp() << "," << nodes << "," << workers << "," << avg_us << "," << min_us << "," << max_us << "," << med_us << ","
-      << std::fixed << std::setprecision(2) << success_pct << "," << drop_pct << "," << std::fixed << std::setprecision(6) << wall_time_s << "\n";
+    if (newFile) f << PERF_CSV_HEADER << "\n";
+    f << currentTimestamp() << "," << nodes << "," << workers << "," << s.avg_us << "," << s.min_us << "," << s.max_us << "," << s.med_us << ","
+      << s.p90_us << "," << s.p99_us << "," << s.p999_us << "," << s.p9999_us << ","
+      << std::fixed << std::setprecision(2) << s.success_pct << "," << s.drop_pct << "," << std::fixed << std::setprecision(6) << s.run_time_s << "\n";
     f.close();
 }
-void write_summary_txt(
-    int nodes, int workers, long long avg_us, long long min_us, long long max_us, long long med_us,
-    double success_pct, double drop_pct, double wall_time_s, const std::string& filename
-) {
+
+// The quantile ticks apply_quantiles picked, in ms
+void write_percentile_dump(std::ostream &out, const RunSummary &s) {
+    out << "Node Time Percentile Distribution (" << s.latency_count << " nodes):\n";
+    out << std::fixed;
+    for (const auto &[q, us] : s.distribution)
+        out << "  " << std::setprecision(6) << std::setw(11) << 100.0 * q << " %  " << std::setprecision(3) << std::setw(12) << us / 1000.0 << " ms\n";
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+void write_summary_txt(const Config &cfg, int workers, const RunSummary &s, const std::string& filename) {
     std::ofstream fout(filename, std::ios::app);
     if (!fout.good()) return;
     fout << "Performance Summary Report\n";
     fout << "Generated: " << currentTimestamp() << "\n";
     fout << "-----------------------------------------\n";
-    fout << "Nodes: " << nodes << "\n";
+    fout << "Nodes: " << cfg.nodes << "\n";
     fout << "Workers: " << workers << "\n";
-    fout << "Average Time Per Node: " << (avg_us/1000.0) << " ms\n";
-    fout << "Minimum Time Observed: " << (min_us/1000.0) << " ms\n";
-    fout << "Maximum Time Observed: " << (max_us/1000.0) << " ms\n";
-    fout << "Median Time Per Node: " << (med_us/1000.0) << " ms\n";
-    fout << "Success Percentage: " << std::fixed << std::setprecision(2) << success_pct << " %\n";
-    fout << "Dropped Percentage: " << std::fixed << std::setprecision(2) << drop_pct << " %\n";
-    fout << "Run Wall Time: " << std::fixed << std::setprecision(6) << wall_time_s << " s\n";
+    fout << "Engine: " << engine_name(cfg.engine) << "\n";
+    if (cfg.engine == Engine::Threads) {
+        fout << "Scheduler: " << scheduler_name(cfg.scheduler);
+        if (cfg.scheduler == Scheduler::Steal)
+            fout << " (" << s.steals << " steals, busy max/mean " << std::fixed << std::setprecision(3) << s.busy_imbalance << std::defaultfloat << std::setprecision(6) << ")";
+        fout << "\n";
+    }
+    if (cfg.engine == Engine::Pipeline) {
+        fout << "Pipeline Stages: (queue depths over time in pipeline_queues.csv)\n";
+        for (const auto &st : s.stages) {
+            fout << "  " << st.name << ": " << st.workers << " workers, " << st.items << " items, utilization " << std::fixed << std::setprecision(1)
+                 << 100.0 * st.utilization << " %, queue wait avg " << std::setprecision(3) << st.avg_wait_us / 1000.0 << " ms / max " << st.max_wait_us / 1000.0
+                 << " ms, depth avg " << std::setprecision(1) << st.avg_depth << " / max " << st.max_depth << "\n";
+        }
+        fout << std::defaultfloat << std::setprecision(6);
+    }
+    fout << "CPU Features: " << cpu_features_line() << "\n";
+    fout << "Kernels: " << kernel_selection_line() << "\n";
+    fout << "Cipher Mode: " << cipher_mode_name(cfg.cipher) << "\n";
+    fout << "Wire Format: " << wire_format_name(cfg.wire) << "\n";
+    fout << "Streamed Bodies: ";
+    if (cfg.stream_frame_bytes > 0) fout << cfg.stream_frame_bytes << " B frames, window " << cfg.stream_window << "\n";
+    else fout << "off\n";
+    fout << "Seed: " << cfg.seed << " (philox streams per node and request)\n";
+    fout << "Arrivals: ";
+    if (cfg.arrival_rate > 0) fout << arrival_process_name(cfg.arrival) << " at " << cfg.arrival_rate << " nodes/s (open loop, times from intended start)\n";
+    else fout << "closed loop\n";
+    fout << "Chunked Bodies: ";
+    if (cfg.chunk_bytes > 0) fout << cfg.chunk_bytes << " B gcm chunks on " << cfg.crypto_threads << " threads\n";
+    else fout << "off\n";
+    fout << "MW Validation: " << mw_validation_name(cfg.mw_validation) << "\n";
+    fout << "Requests Per Node: " << cfg.requests_per_node << "\n";
+    fout << "Token TTL: " << cfg.token_ttl_ms << " ms\n";
+    fout << "Node Keys: " << key_mode_name(cfg.keys) << " (directory " << std::fixed << std::setprecision(1)
+         << s.key_directory_bytes / (1024.0 * 1024.0) << " MB, built in " << std::setprecision(3) << s.key_setup_ms << " ms)\n";
+    fout << std::defaultfloat << std::setprecision(6);
+    fout << "Key Rotations: " << s.key_rotations << " (every " << cfg.rotate_every_ms << " ms, stale-epoch rejects " << s.stale_epoch_rejects << ")\n";
+    fout << "Average Time Per Node: " << (s.avg_us/1000.0) << " ms\n";
+    fout << "Minimum Time Observed: " << (s.min_us/1000.0) << " ms\n";
+    fout << "Maximum Time Observed: " << (s.max_us/1000.0) << " ms\n";
+    fout << "Median Time Per Node: " << (s.med_us/1000.0) << " ms\n";
+    fout << "P90 Time Per Node: " << (s.p90_us/1000.0) << " ms\n";
+    fout << "P99 Time Per Node: " << (s.p99_us/1000.0) << " ms\n";
+    fout << "P99.9 Time Per Node: " << (s.p999_us/1000.0) << " ms\n";
+    fout << "P99.99 Time Per Node: " << (s.p9999_us/1000.0) << " ms\n";
+    fout << "Quantile Method: " << s.quantile_method << " (relative error <= " << std::fixed << std::setprecision(3) << 100.0 * s.quantile_error << " %";
+    if (s.quantile_bins > 0) fout << ", " << s.quantile_bins << " bins";
+    fout << ")\n" << std::defaultfloat << std::setprecision(6);
+    fout << "Average Queue Wait: " << (s.avg_queue_us/1000.0) << " ms\n";
+    fout << "Average Time Per Request: " << (s.avg_request_us/1000.0) << " ms\n";
+    fout << "Time Per Node By Phase (mean / p50 / p99 ms):\n" << std::fixed << std::setprecision(3);
+    for (int p = 0; p <= PHASE_COUNT; ++p) {
+        fout << "  " << std::left << std::setw(12) << (p < PHASE_COUNT ? PHASE_NAMES[p] : "other") << std::right
+             << s.phases[p].mean_us / 1000.0 << " / " << s.phases[p].p50_us / 1000.0 << " / " << s.phases[p].p99_us / 1000.0 << "\n";
+    }
+    fout << std::defaultfloat << std::setprecision(6);
+    fout << "Total Requests: " << s.requests << "\n";
+    fout << "TA Token Issues: " << s.ta_issues << "\n";
+    fout << "TA Issues Per Request: " << std::fixed << std::setprecision(4) << (s.requests ? s.ta_issues / (double)s.requests : 0.0) << "\n";
+    fout << "Success Percentage: " << std::fixed << std::setprecision(2) << s.success_pct << " %\n";
+    fout << "Dropped Percentage: " << std::fixed << std::setprecision(2) << s.drop_pct << " %\n";
+    fout << "Average Wire Bytes Per Request: " << std::fixed << std::setprecision(1) << s.avg_wire_bytes << " B\n";
+    fout << "Peak Request Buffer: " << std::fixed << std::setprecision(1) << s.max_request_buffer_bytes / 1024.0 << " KB\n";
+    fout << "Heap Allocations Per Request: " << std::fixed << std::setprecision(2) << s.allocs_per_request
+         << (cfg.arena && cfg.wire == WireFormat::Binary ? " (arena)" : " (string path)") << "\n";
+    fout << (cfg.engine == Engine::Des ? "Simulated Run Time: " : "Run Wall Time: ") << std::fixed << std::setprecision(6) << s.run_time_s << " s\n";
+    write_percentile_dump(fout, s);
     fout << "-----------------------------------------\n\n";
     fout.close();
 }
 
+// ---------- Microbenchmarks (--bench NAME) ----------
+std::atomic<size_t> g_bench_sink{0};   // keeps benchmarked results observable
+
+template <typename F>
+double bench_ns_per_op(int iters, F &&fn) {
+    for (int i = 0; i < std::max(iters / 10, 1); ++i) fn();   // warmup
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; ++i) fn();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(t1 - t0).count() / iters;
+}
+
+// Per-call RNG + key schedule (old path) vs the per-thread crypto context. Frames are
+// sealed and opened under one shared key, under 16 per-node keys that stay cached in the
+// context, and under 4096 per-node keys, more than it caches, so every message is its
+// node's first on the thread. "setups/msg" counts the key schedules the context ran.
+void bench_crypto_ctx(const Config &cfg) {
+    string payload(cfg.payload_bytes, 'A');
+    const string aad = node_id_string(0);
+    auto node_keys = [](uint32_t n) {
+        CryptoPP::SecByteBlock master = KeyRing::ReadGuard(g_keys).current().node_mw;
+        std::vector<CryptoPP::SecByteBlock> keys(n, CryptoPP::SecByteBlock(NODE_KEY_BYTES));
+        for (uint32_t i = 0; i < n; ++i) derive_node_key(master, "node-mw", i, keys[i].begin());
+        return keys;
+    };
+    struct KeyCase {
+        const char *name;
+        std::vector<CryptoPP::SecByteBlock> keys;
+    };
+    const KeyCase cases[] = {{"shared", {KEY_NODE_MW}}, {"node-warm", node_keys(16)}, {"node-cold", node_keys(4096)}};
+
+    cout << "crypto-ctx: " << cfg.bench_iters << " iters, payload " << cfg.payload_bytes << " bytes\n";
+    for (bool ctx : {false, true}) {
+        g_use_crypto_ctx = ctx;
+        double tok = bench_ns_per_op(cfg.bench_iters, [&] { g_bench_sink += genTokenHex(16).size(); });
+        cout << "genTokenHex " << (ctx ? "context" : "per-call") << ": " << std::fixed << std::setprecision(1) << tok << " ns\n";
+    }
+    cout << std::left << std::setw(8) << "cipher" << std::setw(11) << "keys" << std::setw(10) << "path" << std::right
+         << std::setw(14) << "encrypt ns" << std::setw(14) << "decrypt ns" << std::setw(12) << "setups/msg" << "\n";
+    int calls = cfg.bench_iters + std::max(cfg.bench_iters / 10, 1);   // bench_ns_per_op's warmup included
+    for (CipherMode mode : {CipherMode::Cbc, CipherMode::Gcm}) {
+        g_cipher_mode = mode;
+        for (const KeyCase &kc : cases) {
+            std::vector<string> frames;
+            for (const auto &key : kc.keys) frames.push_back(aesEncryptFrame(key, payload, aad));
+            for (bool ctx : {false, true}) {
+                g_use_crypto_ctx = ctx;
+                size_t e = 0, d = 0;
+                uint64_t setups = CryptoContext::local().key_setups();
+                double enc = bench_ns_per_op(cfg.bench_iters, [&] {
+                    g_bench_sink += aesEncryptFrame(kc.keys[e++ % kc.keys.size()], payload, aad).size();
+                });
+                double dec = bench_ns_per_op(cfg.bench_iters, [&] {
+                    size_t k = d++ % kc.keys.size();
+                    g_bench_sink += aesDecryptFrame(kc.keys[k], frames[k], aad).size();
+                });
+                // The per-call path schedules a fresh key for every message
+                double per_msg = ctx ? (CryptoContext::local().key_setups() - setups) / (2.0 * calls) : 1.0;
+                cout << std::left << std::setw(8) << cipher_mode_name(mode) << std::setw(11) << kc.name << std::setw(10) << (ctx ? "context" : "per-call")
+                     << std::right << std::fixed << std::setprecision(1) << std::setw(14) << enc << std::setw(14) << dec
+                     << std::setprecision(3) << std::setw(12) << per_msg << "\n";
+            }
+        }
+    }
+    cout << std::defaultfloat << std::setprecision(6);
+    g_use_crypto_ctx = cfg.crypto_ctx;
+    g_cipher_mode = cfg.cipher;
+}
+
+// CBC vs GCM on the binary frame path, side by side across payload sizes
+void bench_cipher_modes(const Config &cfg) {
+    const string aad = NODE_ID_BASE + "0";
+    cout << "cipher-modes: " << cfg.bench_iters << " iters per cell\n";
+    cout << std::setw(8) << "bytes" << std::setw(6) << "mode" << std::setw(14) << "encrypt ns" << std::setw(14) << "decrypt ns"
+         << std::setw(12) << "enc MB/s" << std::setw(12) << "dec MB/s" << "\n";
+    for (size_t bytes : {64, 512, 4096, 65536}) {
+        string payload(bytes, 'A');
+        int iters = std::max(1, (int)(cfg.bench_iters * 512 / std::max<size_t>(bytes, 512)));
+        for (CipherMode mode : {CipherMode::Cbc, CipherMode::Gcm}) {
+            g_cipher_mode = mode;
+            string sample = aesEncryptFrame(KEY_NODE_MW, payload, aad);
+            double enc = bench_ns_per_op(iters, [&] { g_bench_sink += aesEncryptFrame(KEY_NODE_MW, payload, aad).size(); });
+            double dec = bench_ns_per_op(iters, [&] { g_bench_sink += aesDecryptFrame(KEY_NODE_MW, sample, aad).size(); });
+            cout << std::setw(8) << bytes << std::setw(6) << cipher_mode_name(mode) << std::fixed << std::setprecision(1)
+                 << std::setw(14) << enc << std::setw(14) << dec
+                 << std::setw(12) << (bytes * 1e3 / enc) << std::setw(12) << (bytes * 1e3 / dec) << "\n";
+        }
+    }
+    g_cipher_mode = cfg.cipher;
+}
+
+// Crypto++ filter pipeline vs each in-tree hex kernel, 16 B to 64 KB
+void bench_hex(const Config &cfg) {
+    cout << "hex: " << cfg.bench_iters << " iters at 16 B (scaled down for larger inputs), MB/s of raw bytes\n";
+    auto kernels = hex_kernels_available();
+    cout << std::setw(8) << "bytes" << std::setw(8) << "op" << std::setw(10) << "pipeline";
+    for (const auto &k : kernels) cout << std::setw(10) << k.name;
+    cout << "\n";
+    for (size_t bytes = 16; bytes <= 65536; bytes *= 4) {
+        string raw(bytes, '\0');
+        random_block((byte*)raw.data(), raw.size());
+        string hex = toHexPipeline(raw);
+        string enc_out(2 * bytes, '\0'), dec_out(bytes, '\0');
+        int iters = std::max(1, (int)(cfg.bench_iters * 16 / bytes));
+        auto mbps = [&](double ns) { return bytes * 1e3 / ns; };
+
+        cout << std::setw(8) << bytes << std::setw(8) << "encode" << std::fixed << std::setprecision(1)
+             << std::setw(10) << mbps(bench_ns_per_op(iters, [&] { g_bench_sink += toHexPipeline(raw).size(); }));
+        for (const auto &k : kernels) {
+            cout << std::setw(10) << mbps(bench_ns_per_op(iters, [&] {
+                k.encode((const byte*)raw.data(), bytes, enc_out.data());
+                g_bench_sink += (size_t)enc_out[0];
+            }));
+        }
+        cout << "\n" << std::setw(8) << bytes << std::setw(8) << "decode"
+             << std::setw(10) << mbps(bench_ns_per_op(iters, [&] { g_bench_sink += fromHexPipeline(hex).size(); }));
+        for (const auto &k : kernels) {
+            cout << std::setw(10) << mbps(bench_ns_per_op(iters, [&] {
+                g_bench_sink += k.decode(hex.data(), bytes, (byte*)dec_out.data());
+            }));
+        }
+        cout << "\n";
+    }
+    cout << "selected kernel: " << hex_kernel().name << "\n";
+}
+
+// Expected-token table: fill cost, memory and validate throughput at 10K / 1M / 10M entries
+void bench_mw_table(const Config &cfg) {
+    // Deterministic token bytes per node so lookups can rebuild the presented record
+    const uint64_t issued_ms = (uint64_t)unix_ms();
+    auto record_for = [issued_ms](uint32_t id, byte *out) {
+        TokenRecord r;
+        r.node_id = id;
+        uint64_t x = id * 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < TOKEN_BYTES; ++i) { x ^= x >> 29; x *= 0xbf58476d1ce4e5b9ULL; r.token[i] = (byte)(x >> 56); }
+        r.issued_ms = issued_ms;
+        r.ttl_ms = TOKEN_TTL_MS;
+        r.pack(out);
+        return r;
+    };
+    int threads = std::max(cfg.workers, 1);
+    cout << "mw-table: " << cfg.bench_iters << " validations per thread, 1 and " << threads << " threads\n";
+    cout << std::setw(10) << "entries" << std::setw(12) << "fill ns/op" << std::setw(10) << "MB"
+         << std::setw(14) << "1T ns/lookup" << std::setw(12) << "1T Mops/s" << std::setw(12) << "NT Mops/s" << "\n";
+    for (size_t entries : {(size_t)10000, (size_t)1000000, (size_t)10000000}) {
+        auto table = std::make_unique<ExpectedTokenTable>();
+        byte rec[TOKEN_RECORD_BYTES];
+        auto t0 = std::chrono::steady_clock::now();
+        table->reserve(entries);
+        for (uint32_t id = 0; id < entries; ++id) table->put(record_for(id, rec));
+        auto t1 = std::chrono::steady_clock::now();
+        double fill_ns = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(t1 - t0).count() / entries;
+
+        auto lookups = [&](int iters, uint32_t seed) {
+            std::mt19937 pick(seed);
+            std::uniform_int_distribution<uint32_t> any(0, (uint32_t)entries - 1);
+            byte presented[TOKEN_RECORD_BYTES];
+            long long now = unix_ms();
+            size_t ok = 0;
+            for (int i = 0; i < iters; ++i) {
+                record_for(any(pick), presented);
+                ok += table->validate(presented, now);
+            }
+            if (ok != (size_t)iters) cerr << "mw-table: " << (iters - ok) << " lookups failed validation\n";
+            g_bench_sink += ok;
+        };
+        double one_ns = bench_ns_per_op(1, [&] { lookups(cfg.bench_iters, 1); }) / cfg.bench_iters;
+
+        auto m0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) pool.emplace_back(lookups, cfg.bench_iters, (uint32_t)t + 2);
+        for (auto &t : pool) t.join();
+        auto m1 = std::chrono::steady_clock::now();
+        double multi_s = std::chrono::duration_cast<std::chrono::duration<double>>(m1 - m0).count();
+
+        cout << std::setw(10) << entries << std::fixed << std::setprecision(1) << std::setw(12) << fill_ns
+             << std::setw(10) << table->memory_bytes() / (1024.0 * 1024.0)
+             << std::setw(14) << one_ns << std::setw(12) << (1e3 / one_ns)
+             << std::setw(12) << (threads * (double)cfg.bench_iters / multi_s / 1e6) << "\n";
+    }
+}
+
+// Full per-request crypto (issue, node build, send, validate) under each middleware validation mode
+void bench_mw_validation(const Config &cfg) {
+    cout << "mw-validation: " << cfg.bench_iters << " requests per mode, payload " << cfg.payload_bytes
+         << " bytes, cipher " << cipher_mode_name(cfg.cipher) << "\n";
+    cout << std::left << std::setw(10) << "mode" << std::right << std::setw(14) << "issue ns" << std::setw(16) << "request ns"
+         << std::setw(14) << "req/s" << std::setw(14) << "wire bytes" << "\n";
+    for (MwValidation mode : {MwValidation::Decrypt, MwValidation::Table, MwValidation::Mac}) {
+        g_mw_validation = mode;
+        g_mw_tokens.reserve(cfg.nodes);
+        uint32_t next_id = 0;
+        double issue_ns = bench_ns_per_op(cfg.bench_iters, [&] {
+            g_bench_sink += TA_issue_tokens_for_node(next_id++ % (uint32_t)cfg.nodes).enc_for_node.size();
+        });
+        int idx = 0;
+        size_t wire = 0, ok = 0;
+        double req_ns = bench_ns_per_op(cfg.bench_iters, [&] {
+            NodeSession session(idx++ % cfg.nodes);
+            node_fetch_token(session);
+            NodeRequest req = node_build_request(session, cfg, false);
+            ok += node_send_and_mw_validate(req);
+            wire = req.wire_bytes;
+        });
+        if (ok == 0) cerr << "mw-validation: no request validated in mode " << mw_validation_name(mode) << "\n";
+        cout << std::left << std::setw(10) << mw_validation_name(mode) << std::right << std::fixed << std::setprecision(1)
+             << std::setw(14) << issue_ns << std::setw(16) << req_ns << std::setw(14) << (1e9 / req_ns)
+             << std::setw(14) << wire << "\n";
+    }
+    g_mw_validation = cfg.mw_validation;
+}
+
+// Token reuse sweep on the des engine: amortized latency and TA load vs requests per node
+void bench_token_reuse(const Config &cfg) {
+    int workers = std::max(std::min(cfg.workers, cfg.nodes), 1);
+    cout << "token-reuse: des engine, " << cfg.nodes << " nodes, " << workers << " workers, token ttl " << cfg.token_ttl_ms << " ms\n";
+    cout << std::setw(8) << "req/node" << std::setw(14) << "avg req ms" << std::setw(14) << "TA issues"
+         << std::setw(14) << "TA per req" << std::setw(12) << "success %" << std::setw(14) << "sim req/s" << "\n";
+    for (int reuse : {1, 2, 5, 10, 50, 100}) {
+        Config run_cfg = cfg;
+        run_cfg.requests_per_node = reuse;
+        std::vector<NodeMetrics> results(cfg.nodes);
+        if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(cfg.nodes);
+        RunSummary s = summarize(results, run_des(run_cfg, Arrivals{}, workers, results));
+        cout << std::setw(8) << reuse << std::fixed << std::setprecision(3) << std::setw(14) << (s.avg_request_us / 1000.0)
+             << std::setw(14) << s.ta_issues << std::setprecision(4) << std::setw(14) << (s.requests ? s.ta_issues / (double)s.requests : 0.0)
+             << std::setprecision(2) << std::setw(12) << s.success_pct
+             << std::setprecision(1) << std::setw(14) << (s.run_time_s > 0 ? s.requests / s.run_time_s : 0.0) << "\n";
+    }
+}
+
+// Per-node key directory: build time and memory at 10K / 1M / 2M nodes, lookup cost per mode,
+// and what per-node keys add to the middleware's validation path
+void bench_key_directory(const Config &cfg) {
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    cout << "key-directory: " << cfg.bench_iters << " lookups per cell, precompute on " << threads << " threads\n";
+    cout << std::setw(10) << "nodes" << std::setw(12) << "build ms" << std::setw(10) << "MB"
+         << std::setw(14) << "precomp ns" << std::setw(14) << "lazy cold ns" << std::setw(14) << "lazy warm ns" << "\n";
+    for (uint32_t nodes : {10000u, 1000000u, 2000000u}) {
+        auto lookups = [&](KeyDirectory &dir, uint32_t seed) {
+            std::mt19937 pick(seed);
+            std::uniform_int_distribution<uint32_t> any(0, nodes - 1);
+            return bench_ns_per_op(1, [&] {
+                for (int i = 0; i < cfg.bench_iters; ++i) g_bench_sink += dir.lookup(KeyDirectory::Key::NodeMw, any(pick))[0];
+            }) / cfg.bench_iters;
+        };
+        auto pre = std::make_unique<KeyDirectory>();
+        auto t0 = std::chrono::steady_clock::now();
+        pre->build(KEY_TA_NODE, KEY_NODE_MW, nodes, true, threads);
+        double build_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(std::chrono::steady_clock::now() - t0).count();
+        double pre_ns = lookups(*pre, 1);
+        size_t pre_bytes = pre->memory_bytes();
+        pre.reset();
+
+        // The warmup pass inside bench_ns_per_op touches the same node numbers, so "cold" uses a fresh seed per pass
+        auto lazy = std::make_unique<KeyDirectory>();
+        lazy->build(KEY_TA_NODE, KEY_NODE_MW, nodes, false, threads);
+        std::mt19937 cold_pick(7);
+        std::uniform_int_distribution<uint32_t> any(0, nodes - 1);
+        double cold_ns = bench_ns_per_op(cfg.bench_iters, [&] { g_bench_sink += lazy->lookup(KeyDirectory::Key::NodeMw, any(cold_pick))[0]; });
+        double warm_ns = lookups(*lazy, 7);
+
+        cout << std::setw(10) << nodes << std::fixed << std::setprecision(1) << std::setw(12) << build_ms
+             << std::setw(10) << pre_bytes / (1024.0 * 1024.0) << std::setw(14) << pre_ns << std::setw(14) << cold_ns
+             << std::setw(14) << warm_ns << "\n";
+    }
+
+    // Node->MW request with the middleware key lookup on its hot path
+    uint32_t nodes = (uint32_t)cfg.nodes;
+    cout << "validation path, " << nodes << " nodes, payload " << cfg.payload_bytes << " bytes:\n";
+    cout << std::left << std::setw(14) << "keys" << std::right << std::setw(14) << "request ns" << "\n";
+    for (KeyMode mode : {KeyMode::Shared, KeyMode::Precomputed, KeyMode::Lazy}) {
+        g_key_mode = mode;
+        g_keys.reset(build_key_set(KEY_TA_NODE, KEY_NODE_MW, KEY_TA_MW, nodes, threads));
+        if (g_mw_validation == MwValidation::Table) g_mw_tokens.reserve(nodes);
+        std::vector<NodeSession> sessions;
+        sessions.reserve(nodes);
+        for (uint32_t i = 0; i < nodes; ++i) {
+            sessions.emplace_back((int)i);
+            node_fetch_token(sessions.back());
+        }
+        uint32_t idx = 0;
+        size_t ok = 0;
+        double req_ns = bench_ns_per_op(cfg.bench_iters, [&] {
+            NodeRequest req = node_build_request(sessions[idx++ % nodes], cfg, false);
+            ok += node_send_and_mw_validate(req);
+        });
+        if (ok == 0) cerr << "key-directory: no request validated with keys " << key_mode_name(mode) << "\n";
+        cout << std::left << std::setw(14) << key_mode_name(mode) << std::right << std::fixed << std::setprecision(1)
+             << std::setw(14) << req_ns << "\n";
+    }
+    g_key_mode = cfg.keys;
+}
+
+// Closed-loop request crypto on cfg.workers threads while keys rotate every cfg.rotate_every_ms
+// (200 ms if unset). Compares throughput and tail latency inside rotation windows with the rest.
+void bench_key_rotation(const Config &cfg) {
+    int every_ms = cfg.rotate_every_ms > 0 ? cfg.rotate_every_ms : 200;
+    int threads = std::max(cfg.workers, 1);
+    auto run_for = std::chrono::milliseconds(every_ms * 20);
+    cout << "key-rotation: " << threads << " threads, " << cfg.nodes << " nodes, keys " << key_mode_name(cfg.keys)
+         << ", rotating every " << every_ms << " ms for " << run_for.count() << " ms\n";
+
+    using clk = std::chrono::steady_clock;
+    struct Sample { clk::time_point done; long long ns; };
+    std::vector<std::vector<Sample>> samples(threads);
+    std::atomic<bool> stop{false};
+    std::atomic<long long> failed{0};
+    int rotations_before = g_key_rotations.load();
+    long long stale_before = g_stale_epoch_rejects.load();
+
+    auto t_begin = clk::now();
+    KeyRotator rotator(every_ms);
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            std::vector<NodeSession> sessions;
+            for (int i = t; i < cfg.nodes; i += threads) sessions.emplace_back(i);
+            if (sessions.empty()) return;
+            size_t next = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                NodeSession &s = sessions[next++ % sessions.size()];
+                auto t0 = clk::now();
+                if (s.needs_token(protocol_now_ms())) node_fetch_token(s);
+                NodeRequest req = node_build_request(s, cfg, false);
+                if (!node_send_and_mw_validate(req)) failed.fetch_add(1, std::memory_order_relaxed);
+                auto t1 = clk::now();
+                samples[t].push_back({t1, std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count()});
+            }
+        });
+    }
+    std::this_thread::sleep_for(run_for);
+    stop.store(true);
+    for (auto &th : pool) th.join();
+    rotator.stop();
+    auto t_end = clk::now();
+
+    // A request is "during rotation" if it completed while a new key set was being built or installed
+    const auto &windows = rotator.windows();
+    std::vector<long long> steady, rotating;
+    for (const auto &per_thread : samples) {
+        for (const auto &s : per_thread) {
+            auto w = std::upper_bound(windows.begin(), windows.end(), s.done,
+                                      [](clk::time_point t, const KeyRotator::Window &win) { return t < win.start; });
+            bool in_rotation = w != windows.begin() && s.done <= std::prev(w)->end;
+            (in_rotation ? rotating : steady).push_back(s.ns);
+        }
+    }
+    double rotating_s = 0.0;
+    for (const auto &w : windows) rotating_s += std::chrono::duration<double>(w.end - w.start).count();
+    double steady_s = std::chrono::duration<double>(t_end - t_begin).count() - rotating_s;
+
+    cout << "rotations: " << (g_key_rotations.load() - rotations_before) << ", avg rebuild "
+         << std::fixed << std::setprecision(2) << (windows.empty() ? 0.0 : rotating_s * 1e3 / windows.size()) << " ms"
+         << ", failed requests: " << failed.load() << ", stale-epoch rejects: " << (g_stale_epoch_rejects.load() - stale_before) << "\n";
+    cout << std::left << std::setw(10) << "phase" << std::right << std::setw(12) << "requests" << std::setw(12) << "req/s"
+         << std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "p99.9 us" << std::setw(12) << "max us" << "\n";
+    for (auto *v : {&steady, &rotating}) {
+        double secs = (v == &steady) ? steady_s : rotating_s;
+        size_t n = v->size();
+        double p50 = percentile_of_vec(*v, 0.50) / 1000.0, p99 = percentile_of_vec(*v, 0.99) / 1000.0, p999 = percentile_of_vec(*v, 0.999) / 1000.0;
+        double mx = v->empty() ? 0.0 : *std::max_element(v->begin(), v->end()) / 1000.0;
+        cout << std::left << std::setw(10) << (v == &steady ? "steady" : "rotating") << std::right << std::setw(12) << n
+             << std::setprecision(1) << std::setw(12) << (secs > 0 ? n / secs : 0.0)
+             << std::setw(12) << p50 << std::setw(12) << p99 << std::setw(12) << p999 << std::setw(12) << mx << "\n";
+    }
+}
+
+// Heap allocations and time per request, string-per-step path vs arena + span crypto,
+// for a request on a cached token and for one that also fetches a fresh token
+void bench_request_allocs(const Config &cfg) {
+    cout << "request-allocs: " << cfg.bench_iters << " requests per cell, payload " << cfg.payload_bytes
+         << " bytes, cipher " << cipher_mode_name(cfg.cipher) << ", wire " << wire_format_name(cfg.wire) << "\n";
+    cout << std::left << std::setw(10) << "mode" << std::setw(8) << "path" << std::right
+         << std::setw(14) << "cached allocs" << std::setw(12) << "cached ns" << std::setw(14) << "fetch allocs" << std::setw(12) << "fetch ns" << "\n";
+    uint32_t nodes = (uint32_t)std::max(1, std::min(cfg.nodes, cfg.bench_iters));
+    for (MwValidation mode : {MwValidation::Table, MwValidation::Mac, MwValidation::Decrypt}) {
+        g_mw_validation = mode;
+        if (mode == MwValidation::Table) g_mw_tokens.reserve(nodes);
+        for (bool arena : {false, true}) {
+            g_use_arena = arena;
+            std::vector<NodeSession> sessions;
+            sessions.reserve(nodes);
+            for (uint32_t i = 0; i < nodes; ++i) {
+                sessions.emplace_back((int)i);
+                node_fetch_token(sessions.back());
+            }
+            auto run = [&](bool fetch) {
+                uint32_t idx = 0;
+                size_t ok = 0;
+                unsigned long long allocs = 0;
+                double ns = bench_ns_per_op(cfg.bench_iters, [&] {
+                    NodeSession &s = sessions[idx++ % nodes];
+                    allocs += count_allocs([&] {
+                        if (fetch) node_fetch_token(s);
+                        NodeRequest req = node_build_request(s, cfg, false);
+                        ok += node_send_and_mw_validate(req);
+                    });
+                });
+                if (ok == 0) cerr << "request-allocs: no request validated in mode " << mw_validation_name(mode) << "\n";
+                // bench_ns_per_op also runs a warmup pass
+                int calls = cfg.bench_iters + std::max(cfg.bench_iters / 10, 1);
+                return std::make_pair(allocs / (double)calls, ns);
+            };
+            auto cached = run(false);
+            auto fetched = run(true);
+            cout << std::left << std::setw(10) << mw_validation_name(mode) << std::setw(8) << (arena ? "arena" : "string")
+                 << std::right << std::fixed << std::setprecision(2) << std::setw(14) << cached.first
+                 << std::setprecision(1) << std::setw(12) << cached.second
+                 << std::setprecision(2) << std::setw(14) << fetched.first
+                 << std::setprecision(1) << std::setw(12) << fetched.second << "\n";
+        }
+    }
+    g_use_arena = cfg.arena;
+    g_mw_validation = cfg.mw_validation;
+}
+
+// ---------- Crypto primitive suite (--bench primitives, JSON output) ----------
+struct PrimitiveResult {
+    string name;
+    size_t bytes = 0;            // payload size per op (0 for fixed-size ops)
+    int threads = 1;
+    int iters = 0;               // ops per thread per repetition
+    std::vector<double> rep_ns;  // ns/op of each repetition
+    double ns_per_op = 0.0;      // median over repetitions
+    double cv = 0.0;             // stddev / mean over repetitions
+    double bytes_per_s = 0.0;    // aggregate across threads, at the median
+    double allocs_per_op = 0.0;
+};
+
+// One cell: every repetition starts fresh threads, warms each one up (per-thread crypto
+// context, arena, allocator caches), releases them together, and times the slowest.
+// ns/op is thread-time per op, so it stays comparable across thread counts; contention
+// shows up as ns/op rising with threads. Repetitions continue past min_reps until the
+// coefficient of variation drops under 5% or 3x min_reps have run.
+template <typename F>
+PrimitiveResult run_primitive(const string &name, size_t bytes, int threads, int iters, int min_reps, F &&op) {
+    PrimitiveResult r;
+    r.name = name;
+    r.bytes = bytes;
+    r.threads = threads;
+    r.iters = iters;
+    unsigned long long allocs_total = 0;
+    auto stats = [&] {
+        std::vector<double> v = r.rep_ns;
+        std::sort(v.begin(), v.end());
+        r.ns_per_op = v[v.size() / 2];
+        double mean = std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+        double var = 0.0;
+        for (double x : v) var += (x - mean) * (x - mean);
+        r.cv = mean > 0 ? std::sqrt(var / v.size()) / mean : 0.0;
+    };
+    while (true) {
+        std::atomic<int> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<unsigned long long> allocs(threads, 0);
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t] {
+                for (int i = 0; i < std::max(iters / 10, 1); ++i) op(t);
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+                allocs[t] = count_allocs([&] { for (int i = 0; i < iters; ++i) op(t); });
+            });
+        }
+        while (ready.load() < threads) std::this_thread::yield();
+        auto t0 = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto &th : pool) th.join();
+        double wall_ns = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(std::chrono::steady_clock::now() - t0).count();
+        r.rep_ns.push_back(wall_ns / iters);
+        for (auto a : allocs) allocs_total += a;
+        stats();
+        int reps = (int)r.rep_ns.size();
+        if (reps >= 3 * min_reps || (reps >= min_reps && r.cv < 0.05)) break;
+    }
+    r.allocs_per_op = allocs_total / ((double)r.rep_ns.size() * threads * iters);
+    r.bytes_per_s = bytes ? bytes * threads * 1e9 / r.ns_per_op : 0.0;
+    return r;
+}
+
+void write_primitives_json(const Config &cfg, const std::vector<PrimitiveResult> &results, const string &filename) {
+    std::ofstream fout(filename);
+    if (!fout.is_open()) {
+        cerr << "Could not write " << filename << "\n";
+        return;
+    }
+    fout << std::setprecision(6);
+    fout << "{\n";
+    fout << "  \"suite\": \"primitives\",\n";
+    fout << "  \"timestamp_ms\": " << unix_ms() << ",\n";
+    fout << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+    fout << "  \"config\": {\"cipher\": \"" << cipher_mode_name(cfg.cipher) << "\", \"wire\": \"" << wire_format_name(cfg.wire)
+         << "\", \"mw_validation\": \"" << mw_validation_name(cfg.mw_validation) << "\", \"keys\": \"" << key_mode_name(cfg.keys)
+         << "\", \"kernels\": \"" << kernel_selection_line() << "\", \"force_scalar\": " << (cfg.force_scalar ? "true" : "false")
+         << ", \"crypto_ctx\": " << (cfg.crypto_ctx ? "true" : "false") << ", \"bench_iters\": " << cfg.bench_iters
+         << ", \"min_reps\": " << cfg.bench_reps << "},\n";
+    fout << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const PrimitiveResult &r = results[i];
+        fout << "    {\"name\": \"" << r.name << "\", \"bytes\": " << r.bytes << ", \"threads\": " << r.threads
+             << ", \"iters\": " << r.iters << ", \"reps\": " << r.rep_ns.size()
+             << ", \"ns_per_op\": " << r.ns_per_op << ", \"cv\": " << r.cv
+             << ", \"bytes_per_s\": " << r.bytes_per_s << ", \"ops_per_s\": " << (r.threads * 1e9 / r.ns_per_op)
+             << ", \"allocs_per_op\": " << r.allocs_per_op << ", \"rep_ns_per_op\": [";
+        for (size_t j = 0; j < r.rep_ns.size(); ++j) fout << (j ? ", " : "") << r.rep_ns[j];
+        fout << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    fout << "  ]\n";
+    fout << "}\n";
+}
+
+// toHex, fromHex, deriveKey, genTokenHex, aesEncryptHex, aesDecryptHex (shared key and
+// per-node keys) and TA issue, 16 B to 1 MB for the sized ops, at 1, 2, 4, ... hardware threads
+void bench_primitives(const Config &cfg) {
+    const size_t sizes[] = {16, 256, 4096, 65536, 1 << 20};
+    std::vector<int> thread_counts;
+    int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1; t < hw; t *= 2) thread_counts.push_back(t);
+    thread_counts.push_back(hw);
+    // Big payloads get fewer ops per repetition so every cell costs about the same
+    auto iters_for = [&](size_t bytes) {
+        return std::clamp((int)(cfg.bench_iters * 256.0 / std::max<size_t>(bytes, 256)), 4, cfg.bench_iters);
+    };
+    cout << "primitives: " << cfg.bench_iters << " ops per thread at <=256 B (scaled down for larger inputs), >= "
+         << cfg.bench_reps << " reps per cell, threads";
+    for (int t : thread_counts) cout << " " << t;
+    cout << "\n";
+    cout << std::left << std::setw(16) << "op" << std::right << std::setw(9) << "bytes" << std::setw(8) << "threads"
+         << std::setw(14) << "ns/op" << std::setw(8) << "cv %" << std::setw(12) << "MB/s" << std::setw(12) << "allocs/op" << "\n";
+
+    std::vector<PrimitiveResult> results;
+    auto record = [&](PrimitiveResult r) {
+        cout << std::left << std::setw(16) << r.name << std::right << std::setw(9) << r.bytes << std::setw(8) << r.threads
+             << std::fixed << std::setprecision(1) << std::setw(14) << r.ns_per_op << std::setw(8) << (r.cv * 100.0)
+             << std::setw(12) << (r.bytes_per_s / 1e6) << std::setprecision(2) << std::setw(12) << r.allocs_per_op << "\n";
+        results.push_back(std::move(r));
+    };
+
+    if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(cfg.nodes);
+    std::vector<CryptoPP::SecByteBlock> node_keys(1024, CryptoPP::SecByteBlock(NODE_KEY_BYTES));
+    {
+        CryptoPP::SecByteBlock master = KeyRing::ReadGuard(g_keys).current().node_mw;
+        for (uint32_t i = 0; i < node_keys.size(); ++i) derive_node_key(master, "node-mw", i, node_keys[i].begin());
+    }
+    for (int threads : thread_counts) {
+        for (size_t bytes : sizes) {
+            int iters = iters_for(bytes);
+            string raw(bytes, '\0');
+            random_block((byte*)raw.data(), bytes);
+            string hex = toHex(raw);
+            string sealed = aesEncryptHex(KEY_NODE_MW, raw);
+            std::vector<string> node_sealed;
+            for (const auto &key : node_keys) node_sealed.push_back(aesEncryptHex(key, raw));
+            record(run_primitive("toHex", bytes, threads, iters, cfg.bench_reps, [&](int) { g_bench_sink += toHex(raw).size(); }));
+            record(run_primitive("fromHex", bytes, threads, iters, cfg.bench_reps, [&](int) { g_bench_sink += fromHex(hex).size(); }));
+            record(run_primitive("deriveKey", bytes, threads, iters, cfg.bench_reps, [&](int) { g_bench_sink += deriveKey(raw)[0]; }));
+            record(run_primitive("aesEncryptHex", bytes, threads, iters, cfg.bench_reps, [&](int) { g_bench_sink += aesEncryptHex(KEY_NODE_MW, raw).size(); }));
+            record(run_primitive("aesDecryptHex", bytes, threads, iters, cfg.bench_reps, [&](int) { g_bench_sink += aesDecryptHex(KEY_NODE_MW, sealed).size(); }));
+            // Per-node keys, each thread walking more nodes than its crypto context caches
+            record(run_primitive("aesEncryptNode", bytes, threads, iters, cfg.bench_reps, [&](int t) {
+                thread_local uint32_t next = 0;
+                const auto &key = node_keys[(next++ * (uint32_t)threads + (uint32_t)t) % node_keys.size()];
+                g_bench_sink += aesEncryptHex(key, raw).size();
+            }));
+            record(run_primitive("aesDecryptNode", bytes, threads, iters, cfg.bench_reps, [&](int t) {
+                thread_local uint32_t next = 0;
+                size_t k = (next++ * (uint32_t)threads + (uint32_t)t) % node_keys.size();
+                g_bench_sink += aesDecryptHex(node_keys[k], node_sealed[k]).size();
+            }));
+        }
+        int iters = iters_for(16);
+        record(run_primitive("genTokenHex", 16, threads, iters, cfg.bench_reps, [&](int) { g_bench_sink += genTokenHex(16).size(); }));
+        // Each thread issues for its own stride of nodes so table inserts don't all land on one slot
+        record(run_primitive("TA_issue_tokens", 0, threads, iters, cfg.bench_reps, [&](int t) {
+            thread_local uint32_t next = 0;
+            uint32_t node = (uint32_t)((next++ * (uint32_t)threads + (uint32_t)t) % (uint32_t)cfg.nodes);
+            g_bench_sink += TA_issue_tokens_for_node(node).enc_for_node.size();
+        }));
+    }
+    write_primitives_json(cfg, results, cfg.bench_out);
+    cout << "Results written to: " << cfg.bench_out << endl;
+}
+
+// Large-body latency: single-pass frame vs parallel chunked GCM, seal + verify/open per
+// payload size and thread count (caller included). Uses --chunk-bytes, default 64 KB.
+void bench_chunked(const Config &cfg) {
+    size_t chunk = cfg.chunk_bytes > 0 ? (size_t)cfg.chunk_bytes : 64 * 1024;
+    const size_t sizes[] = {64 * 1024, 256 * 1024, 1 << 20, 4 << 20, 16 << 20};
+    std::vector<int> thread_counts;
+    int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1; t < hw; t *= 2) thread_counts.push_back(t);
+    thread_counts.push_back(hw);
+    cout << "chunked: " << chunk << " byte chunks, seal + open latency in ms (single pass uses cipher "
+         << cipher_mode_name(cfg.cipher) << ")\n";
+    cout << std::setw(10) << "bytes" << std::setw(14) << "single";
+    for (int t : thread_counts) cout << std::setw(10) << (std::to_string(t) + "t");
+    cout << std::setw(12) << "speedup" << "\n";
+
+    for (size_t bytes : sizes) {
+        ArenaScope arena;
+        std::span<byte> plain = arena.alloc(bytes);
+        random_block(plain.data(), plain.size());
+        std::span<byte> frame = arena.alloc(std::max(chunked_frame_bytes(bytes, chunk), frame_bytes(cfg.cipher, bytes, true)));
+        std::span<byte> recovered = arena.alloc(frame.size());
+        const string aad = node_id_string(0);
+        // ~256 MB of payload per cell, at least 3 round trips
+        int iters = std::max(3, (int)((256u << 20) / bytes));
+        auto ms = [&](auto &&fn) { return bench_ns_per_op(iters, fn) / 1e6; };
+
+        double single = ms([&] {
+            size_t n = aesEncryptFrameInto(KEY_NODE_MW, plain, aad, true, frame);
+            g_bench_sink += aesDecryptFrameInto(KEY_NODE_MW, frame.first(n), aad, true, recovered);
+        });
+        cout << std::setw(10) << bytes << std::fixed << std::setprecision(3) << std::setw(14) << single;
+        double best = single;
+        for (int t : thread_counts) {
+            ChunkPool pool((unsigned)t - 1);
+            double chunked = ms([&] {
+                size_t n = aesEncryptChunkedInto(pool, KEY_NODE_MW, plain, aad, chunk, frame);
+                g_bench_sink += aesDecryptChunkedInto(pool, KEY_NODE_MW, frame.first(n), aad, recovered);
+            });
+            best = std::min(best, chunked);
+            cout << std::setw(10) << chunked;
+        }
+        cout << std::setprecision(2) << std::setw(11) << (single / best) << "x\n";
+    }
+}
+
+// Whole-body vs streamed requests: latency and the buffer footprint of one request as the
+// body grows. Uses --stream-frame-bytes (default 64 KB) and --stream-window.
+void bench_streaming(const Config &cfg) {
+    size_t frame = cfg.stream_frame_bytes > 0 ? (size_t)cfg.stream_frame_bytes : 64 * 1024;
+    cout << "streaming: " << frame << " byte frames, window " << cfg.stream_window << ", mw-validation "
+         << mw_validation_name(cfg.mw_validation) << "\n";
+    cout << std::setw(10) << "bytes" << std::setw(14) << "whole ms" << std::setw(14) << "whole KB"
+         << std::setw(14) << "stream ms" << std::setw(14) << "stream KB" << "\n";
+    g_use_arena = true;
+    g_wire_format = WireFormat::Binary;
+    g_chunk_bytes = 0;
+    g_stream_window = (size_t)cfg.stream_window;
+    if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(1);
+    NodeSession session(0);
+    for (size_t bytes : {64u << 10, 1u << 20, 4u << 20, 16u << 20, 64u << 20}) {
+        Config run_cfg = cfg;
+        run_cfg.payload_bytes = (int)bytes;
+        int iters = std::max(3, (int)((256u << 20) / bytes));
+        double ms[2];
+        size_t footprint[2];
+        for (int streamed = 0; streamed < 2; ++streamed) {
+            g_stream_frame_bytes = streamed ? frame : 0;
+            size_t ok = 0;
+            ms[streamed] = bench_ns_per_op(iters, [&] {
+                if (session.needs_token(protocol_now_ms())) node_fetch_token(session);
+                NodeRequest req = node_build_request(session, run_cfg, false);
+                ok += node_send_and_mw_validate(req);
+                footprint[streamed] = req.buffer_bytes;
+            }) / 1e6;
+            if (ok == 0) cerr << "streaming: no request validated at " << bytes << " bytes\n";
+        }
+        cout << std::setw(10) << bytes << std::fixed << std::setprecision(3)
+             << std::setw(14) << ms[0] << std::setprecision(1) << std::setw(14) << footprint[0] / 1024.0
+             << std::setprecision(3) << std::setw(14) << ms[1] << std::setprecision(1) << std::setw(14) << footprint[1] / 1024.0 << "\n";
+    }
+    g_use_arena = cfg.arena;
+    g_wire_format = cfg.wire;
+    g_chunk_bytes = (size_t)cfg.chunk_bytes;
+    g_stream_frame_bytes = (size_t)cfg.stream_frame_bytes;
+}
+
+// Counter vs work stealing on the threads engine with no simulated delays, so only the
+// protocol's CPU work is scheduled. Payloads are heterogeneous (--payload-bytes-max, or
+// 256 B to 256 KB by default) and sessions run 1 and 8 requests.
+void bench_scheduler(const Config &cfg) {
+    Config run_cfg = cfg;
+    run_cfg.node_start_jitter_ms = 0;
+    run_cfg.net_delay_ta_node_min = run_cfg.net_delay_ta_node_max = 0;
+    run_cfg.net_delay_node_mw_min = run_cfg.net_delay_node_mw_max = 0;
+    run_cfg.db_delay_min = run_cfg.db_delay_max = 0;
+    run_cfg.fail_percent = 0;
+    if (run_cfg.payload_bytes_max <= run_cfg.payload_bytes) {
+        run_cfg.payload_bytes = 256;
+        run_cfg.payload_bytes_max = 256 * 1024;
+    }
+    int workers = std::max(std::min(cfg.workers, cfg.nodes), 1);
+    cout << "scheduler: threads engine, " << cfg.nodes << " nodes, " << workers << " workers, payload "
+         << run_cfg.payload_bytes << "-" << run_cfg.payload_bytes_max << " bytes, no simulated delays\n";
+    cout << std::left << std::setw(10) << "scheduler" << std::right << std::setw(10) << "req/node" << std::setw(12) << "wall s"
+         << std::setw(14) << "req/s" << std::setw(18) << "busy max/mean" << std::setw(10) << "steals" << "\n";
+    if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(cfg.nodes);
+    const Arrivals closed_loop;   // StealRun keeps a reference, so it must outlive each run
+    for (int reqs : {1, 8}) {
+        run_cfg.requests_per_node = reqs;
+        for (Scheduler sched : {Scheduler::Counter, Scheduler::Steal}) {
+            std::vector<NodeMetrics> results(cfg.nodes);
+            std::vector<StealPool::WorkerStats> stats(workers);
+            auto t0 = std::chrono::steady_clock::now();
+            if (sched == Scheduler::Steal) {
+                StealRun run(run_cfg, closed_loop, workers, results);
+                stats = run.run();
+            } else {
+                // A counter worker is busy from its start until the counter runs out
+                std::atomic<int> counter{0};
+                std::vector<std::thread> pool;
+                for (int i = 0; i < workers; ++i) {
+                    pool.emplace_back([&, i] {
+                        auto start = std::chrono::steady_clock::now();
+                        worker_func(counter, run_cfg, closed_loop, results);
+                        stats[i].busy_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    });
+                }
+                for (auto &t : pool) t.join();
+            }
+            double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            long long steals = 0, requests = 0;
+            for (const auto &st : stats) steals += st.steals;
+            for (const auto &m : results) requests += m.requests;
+            cout << std::left << std::setw(10) << scheduler_name(sched) << std::right << std::setw(10) << reqs
+                 << std::fixed << std::setprecision(3) << std::setw(12) << wall << std::setprecision(1) << std::setw(14) << (requests / wall)
+                 << std::setprecision(3) << std::setw(18) << busy_imbalance(stats) << std::setw(10) << steals << "\n";
+        }
+    }
+}
+// Finishing a node two ways: push_back into one shared vector behind a mutex (the old
+// path) vs a write to the node's own pre-sized slot. Then whole zero-delay runs on the
+// threads engine with the slot path, from 1 to 64 workers.
+void bench_results(const Config &cfg) {
+    int record_nodes = std::max(cfg.bench_iters * 10, 1000);
+    Config run_cfg = cfg;
+    run_cfg.node_start_jitter_ms = 0;
+    run_cfg.net_delay_ta_node_min = run_cfg.net_delay_ta_node_max = 0;
+    run_cfg.net_delay_node_mw_min = run_cfg.net_delay_node_mw_max = 0;
+    run_cfg.db_delay_min = run_cfg.db_delay_max = 0;
+    cout << "results: " << record_nodes << " recorded node results per cell, then " << cfg.nodes << "-node runs with no simulated delays ("
+         << scheduler_name(cfg.scheduler) << " scheduler)\n";
+    cout << std::setw(8) << "workers" << std::setw(18) << "shared ns/node" << std::setw(16) << "slot ns/node"
+         << std::setw(14) << "run wall s" << std::setw(14) << "run nodes/s" << "\n";
+    if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(cfg.nodes);
+
+    auto record = [&](int workers, bool shared) {
+        // Both vectors start with their pages touched, so only the recording is timed
+        std::vector<NodeMetrics> results(record_nodes);
+        if (shared) results.clear();
+        std::mutex mu;
+        std::atomic<int> counter{0};
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for (int w = 0; w < workers; ++w) {
+            pool.emplace_back([&] {
+                for (int idx = counter.fetch_add(1); idx < record_nodes; idx = counter.fetch_add(1)) {
+                    NodeMetrics m{};
+                    m.node_index = idx;
+                    m.total_us = idx;
+                    m.requests = 1;
+                    if (shared) {
+                        std::lock_guard<std::mutex> lg(mu);
+                        results.push_back(std::move(m));
+                    } else {
+                        results[idx] = std::move(m);
+                    }
+                }
+            });
+        }
+        for (auto &t : pool) t.join();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        g_bench_sink += results.size();
+        return ns / record_nodes;
+    };
+
+    const Arrivals closed_loop;   // StealRun keeps a reference, so it must outlive each run
+    for (int workers : {1, 2, 4, 8, 16, 32, 64}) {
+        double shared_ns = record(workers, true);
+        double slot_ns = record(workers, false);
+
+        std::vector<NodeMetrics> results(cfg.nodes);
+        auto t0 = std::chrono::steady_clock::now();
+        if (cfg.scheduler == Scheduler::Steal) {
+            StealRun run(run_cfg, closed_loop, workers, results);
+            run.run();
+        } else {
+            std::atomic<int> counter{0};
+            std::vector<std::thread> pool;
+            for (int i = 0; i < workers; ++i)
+                pool.emplace_back([&] { worker_func(counter, run_cfg, closed_loop, results); });
+            for (auto &t : pool) t.join();
+        }
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        cout << std::setw(8) << workers << std::fixed << std::setprecision(1) << std::setw(18) << shared_ns << std::setw(16) << slot_ns
+             << std::setprecision(4) << std::setw(14) << wall << std::setprecision(0) << std::setw(14) << (wall > 0 ? cfg.nodes / wall : 0.0) << "\n";
+    }
+    cout << std::defaultfloat << std::setprecision(6);
+}
+
+
+// Open-loop rates around the closed-loop capacity, des engine. "sent" latency starts when a node
+// actually got a worker (what a closed-loop harness reports); "intended" starts at its arrival.
+void bench_arrival_sweep(const Config &cfg) {
+    int workers = std::max(std::min(cfg.workers, cfg.nodes), 1);
+    if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(cfg.nodes);
+    auto run_once = [&](const Config &run_cfg, const Arrivals &arrivals, std::vector<NodeMetrics> &results) {
+        results.assign(cfg.nodes, NodeMetrics{});
+        return run_des(run_cfg, arrivals, workers, results);
+    };
+    Config closed_cfg = cfg;
+    closed_cfg.node_start_jitter_ms = 0;
+    std::vector<NodeMetrics> results;
+    double closed_s = run_once(closed_cfg, Arrivals{}, results);
+    double capacity = closed_s > 0 ? cfg.nodes / closed_s : 0.0;
+    cout << "arrival-sweep: des engine, " << cfg.nodes << " nodes, " << workers << " workers, "
+         << arrival_process_name(cfg.arrival) << " arrivals, closed-loop capacity " << std::fixed << std::setprecision(1) << capacity << " nodes/s\n";
+    if (capacity <= 0) return;
+    cout << std::setw(8) << "load" << std::setw(12) << "offered/s" << std::setw(12) << "achieved/s"
+         << std::setw(14) << "p50 sent ms" << std::setw(14) << "p99 sent ms" << std::setw(16) << "p50 intended" << std::setw(16) << "p99 intended"
+         << std::setw(14) << "avg queue ms" << "\n";
+    for (double load : {0.25, 0.5, 0.75, 0.9, 1.0, 1.1, 1.25}) {
+        Config run_cfg = closed_cfg;
+        run_cfg.arrival_rate = capacity * load;
+        Arrivals arrivals = make_arrivals(run_cfg);
+        double sim_s = run_once(run_cfg, arrivals, results);
+        RunSummary s = summarize(results, sim_s);
+        std::vector<long long> sent;
+        sent.reserve(results.size());
+        for (const auto &m : results)
+            if (m.drops < m.requests) sent.push_back(m.total_us - m.queue_us);
+        cout << std::setprecision(2) << std::setw(8) << load << std::setprecision(1) << std::setw(12) << run_cfg.arrival_rate
+             << std::setw(12) << (sim_s > 0 ? cfg.nodes / sim_s : 0.0) << std::setprecision(3)
+             << std::setw(14) << median_of_vec(sent) / 1000.0 << std::setw(14) << percentile_of_vec(sent, 0.99) / 1000.0
+             << std::setw(16) << s.med_us / 1000.0 << std::setw(16) << s.p99_us / 1000.0
+             << std::setw(14) << s.avg_queue_us / 1000.0 << "\n";
+    }
+    cout << std::defaultfloat << std::setprecision(6);
+}
+
+// Quantile error and memory on a long-tailed sample: exact (sorted vector) vs the
+// HDR histogram vs DDSketch at several accuracies. Each sketch is built as 8 parts
+// merged at the end, the way per-thread sketches are combined after a run.
+void bench_quantiles(const Config &cfg) {
+    size_t n = (size_t)std::max(cfg.bench_iters * 100, 100000);
+    std::mt19937 rng(12345);
+    std::lognormal_distribution<double> body(std::log(20000.0), 0.4);   // ~20 ms sessions
+    std::exponential_distribution<double> tail(1.0 / 200000.0);          // plus a 1% tail averaging 200 ms
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::vector<long long> samples(n);
+    for (auto &v : samples) v = (long long)(body(rng) + (coin(rng) < 0.01 ? tail(rng) : 0.0));
+    std::vector<long long> sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+    const double qs[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+    auto exact_at = [&](double q) { return (double)sorted[std::max<size_t>(1, (size_t)std::ceil(q * n)) - 1]; };
+
+    cout << "quantiles: " << n << " samples, max relative error over p50/p90/p99/p99.9/p99.99, 8 merged parts\n";
+    cout << std::left << std::setw(18) << "method" << std::right << std::setw(12) << "bound %" << std::setw(14) << "observed %"
+         << std::setw(10) << "bins" << std::setw(14) << "memory KB" << std::setw(12) << "ns/add" << "\n";
+    auto row = [&](const string &name, double bound, size_t bins, double bytes, double ns, auto &&value_at) {
+        double worst = 0.0;
+        for (double q : qs) worst = std::max(worst, std::abs(value_at(q) - exact_at(q)) / exact_at(q));
+        cout << std::left << std::setw(18) << name << std::right << std::fixed << std::setprecision(3) << std::setw(12) << 100.0 * bound
+             << std::setw(14) << 100.0 * worst << std::setw(10) << bins << std::setprecision(1) << std::setw(14) << bytes / 1024.0
+             << std::setw(12) << ns << "\n";
+    };
+    auto timed_build = [&](auto &&make, auto &&add) {
+        auto t0 = std::chrono::steady_clock::now();
+        auto parts = std::vector<decltype(make())>();
+        for (int p = 0; p < 8; ++p) parts.push_back(make());
+        for (size_t i = 0; i < n; ++i) add(parts[i % 8], samples[i]);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / n;
+        for (int p = 1; p < 8; ++p) parts[0].merge(parts[p]);
+        return std::make_pair(std::move(parts[0]), ns);
+    };
+
+    row("exact", 0.0, 0, (double)n * sizeof(long long), 0.0, exact_at);
+    auto [hist, hist_ns] = timed_build([] { return LatencyHistogram(); }, [](LatencyHistogram &h, long long v) { h.record(v); });
+    row("hdr histogram", 1.0 / LatencyHistogram::HALF, LatencyHistogram::BUCKETS, LatencyHistogram::BUCKETS * sizeof(uint64_t), hist_ns,
+        [&](double q) { return (double)hist.value_at(q); });
+    for (double accuracy : {0.05, 0.02, 0.01, 0.005, 0.001}) {
+        auto [sketch, ns] = timed_build([&] { return DDSketch(accuracy); }, [](DDSketch &d, long long v) { d.add((double)v); });
+        std::ostringstream name;
+        name << "ddsketch " << accuracy;
+        row(name.str(), accuracy, sketch.bins(), sketch.bins() * sizeof(uint64_t) + sizeof(DDSketch), ns,
+            [&](double q) { return sketch.value_at(q); });
+    }
+    cout << std::defaultfloat << std::setprecision(6);
+}
+
+int run_bench(const Config &cfg) {
+    if (cfg.bench == "crypto-ctx") bench_crypto_ctx(cfg);
+    else if (cfg.bench == "cipher-modes") bench_cipher_modes(cfg);
+    else if (cfg.bench == "hex") bench_hex(cfg);
+    else if (cfg.bench == "mw-table") bench_mw_table(cfg);
+    else if (cfg.bench == "mw-validation") bench_mw_validation(cfg);
+    else if (cfg.bench == "token-reuse") bench_token_reuse(cfg);
+    else if (cfg.bench == "key-directory") bench_key_directory(cfg);
+    else if (cfg.bench == "key-rotation") bench_key_rotation(cfg);
+    else if (cfg.bench == "request-allocs") bench_request_allocs(cfg);
+    else if (cfg.bench == "primitives") bench_primitives(cfg);
+    else if (cfg.bench == "chunked") bench_chunked(cfg);
+    else if (cfg.bench == "streaming") bench_streaming(cfg);
+    else if (cfg.bench == "scheduler") bench_scheduler(cfg);
+    else if (cfg.bench == "results") bench_results(cfg);
+    else if (cfg.bench == "arrival-sweep") bench_arrival_sweep(cfg);
+    else if (cfg.bench == "quantiles") bench_quantiles(cfg);
+    else {
+        cerr << "Unknown benchmark: " << cfg.bench << "\n";
+        return 1;
+    }
+    return 0;
+}
+
 // ---------- Main ----------
 int main(int argc, char** argv) {
     // derive keys
@@ -344,56 +4887,149 @@ int main(int argc, char** argv) {
         print_usage(argv[0]);
         return 1;
     }
+    if (cfg.force_scalar) force_scalar_kernels();
+    g_use_crypto_ctx = cfg.crypto_ctx;
+    g_use_arena = cfg.arena;
+    g_wire_format = cfg.wire;
+    g_cipher_mode = cfg.cipher;
+    g_mw_validation = cfg.mw_validation;
+    g_token_ttl_ms = (uint32_t)cfg.token_ttl_ms;
+    g_token_max_uses = cfg.token_max_uses;
+    g_key_mode = cfg.keys;
+    g_chunk_bytes = (size_t)cfg.chunk_bytes;
+    g_stream_frame_bytes = (size_t)cfg.stream_frame_bytes;
+    g_stream_window = (size_t)cfg.stream_window;
+    g_sketch_accuracy = cfg.sketch_accuracy;
+    if (cfg.chunk_bytes > 0) g_chunk_pool = std::make_unique<ChunkPool>((unsigned)cfg.crypto_threads - 1);
+
+    g_key_directory_nodes = (uint32_t)cfg.nodes;
+    auto keys_start = std::chrono::steady_clock::now();
+    g_keys.reset(build_key_set(KEY_TA_NODE, KEY_NODE_MW, KEY_TA_MW, g_key_directory_nodes, std::thread::hardware_concurrency()));
+    double key_setup_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(std::chrono::steady_clock::now() - keys_start).count();
+    // Benches stay repeatable unless --seed says otherwise
+    std::random_device rd;
+    if (cfg.seed < 0) cfg.seed = cfg.bench.empty() ? (long long)((((uint64_t)rd() << 32) | rd()) >> 1) : 12345;
+    if (!cfg.bench.empty()) return run_bench(cfg);
 
-    cout << "Simulating " << cfg.nodes << " nodes with " << cfg.workers << " workers...\n";
+    cout << "Simulating " << cfg.nodes << " nodes with " << cfg.workers << " workers (engine: " << engine_name(cfg.engine);
+    if (cfg.engine == Engine::Threads) cout << ", scheduler: " << scheduler_name(cfg.scheduler);
+    if (cfg.engine == Engine::Pipeline) cout << ", ta workers: " << cfg.ta_workers << ", mw workers: " << cfg.mw_workers;
+    cout << ")...\n";
     cout << "Network delays: TA->Node " << cfg.net_delay_ta_node_min << "-" << cfg.net_delay_ta_node_max << "ms, "
          << "Node->MW " << cfg.net_delay_node_mw_min << "-" << cfg.net_delay_node_mw_max << "ms, "
          << "DB " << cfg.db_delay_min << "-" << cfg.db_delay_max << "ms\n";
-    cout << "Tamper %: " << cfg.tamper_percent << ", Drop %: " << cfg.fail_percent << ", Payload: " << cfg.payload_bytes << " bytes\n";
+    size_t key_directory_bytes = KeyRing::ReadGuard(g_keys).current().directory.memory_bytes();
+    cout << "CPU: " << cpu_features_line() << "\n";
+    cout << "Kernels: " << kernel_selection_line() << "\n";
+    cout << "Node keys: " << key_mode_name(cfg.keys) << " (" << key_directory_bytes / (1024.0 * 1024.0) << " MB, " << key_setup_ms << " ms)";
+    if (cfg.rotate_every_ms > 0) cout << ", rotating every " << cfg.rotate_every_ms << " ms";
+    cout << "\n";
+    cout << "Requests per node: " << cfg.requests_per_node << ", Token TTL: " << cfg.token_ttl_ms << " ms\n";
+    cout << "Seed: " << cfg.seed << "\n";
+    cout << "Tamper %: " << cfg.tamper_percent << ", Drop %: " << cfg.fail_percent << ", Payload: " << cfg.payload_bytes << " bytes, Cipher: " << cipher_mode_name(cfg.cipher) << "\n";
+    if (cfg.stream_frame_bytes > 0) {
+        cout << "Streamed bodies: " << cfg.stream_frame_bytes << " byte frames, window " << cfg.stream_window;
+        if (!span_wire()) cout << " (ignored: needs --wire binary without --no-arena)";
+        cout << "\n";
+    }
+    if (cfg.chunk_bytes > 0) {
+        cout << "Chunked bodies: " << cfg.chunk_bytes << " byte gcm chunks on " << cfg.crypto_threads << " threads";
+        if (!span_wire()) cout << " (ignored: needs --wire binary without --no-arena)";
+        cout << "\n";
+    }
+    if (cfg.arrival_rate > 0) cout << "Arrivals: " << arrival_process_name(cfg.arrival) << " at " << cfg.arrival_rate << " nodes/s (open loop)\n";
+    else cout << "Arrivals: closed loop\n";
+    if (cfg.stats == StatsMode::Stream) cout << "Stats: stream (ddsketch, " << 100.0 * cfg.sketch_accuracy << " % relative error, no per-node results)\n";
 
-    std::vector<NodeMetrics> results;
-    results.reserve(cfg.nodes);
-    std::mutex res_mutex;
+    // Benches above always keep results; from here on the engines honour --stats
+    g_stats_mode = cfg.stats;
+    std::vector<NodeMetrics> results(cfg.stats == StatsMode::Exact ? cfg.nodes : 0);
+    if (cfg.mw_validation == MwValidation::Table) g_mw_tokens.reserve(cfg.nodes);
     std::atomic<int> counter{0};
 
     auto run_start = std::chrono::high_resolution_clock::now();
 
     // spawn workers
     int workers = std::min(cfg.workers, cfg.nodes);
-    std::vector<std::thread> pool;
-    pool.reserve(workers);
-    std::random_device rd;
-    for (int i=0;i<workers;++i) {
-        std::mt19937 rng(rd() ^ (i * 7919));
-        pool.emplace_back(worker_func, std::ref(counter), std::ref(cfg), std::ref(results), std::ref(res_mutex), std::ref(rng));
+    double sim_total_s = 0.0;
+    long long steals = 0;
+    double imbalance = 0.0;
+    std::vector<StageSummary> stages;
+    Arrivals arrivals = make_arrivals(cfg);
+    g_latency.reset();
+    g_stream_stats.reset();
+    arrivals.start();
+    if (cfg.engine == Engine::Des) {
+        sim_total_s = run_des(cfg, arrivals, workers, results);
+    } else if (cfg.engine == Engine::Coro) {
+        // workers are CPU threads here, not concurrency slots
+        KeyRotator rotator(cfg.rotate_every_ms);
+        run_coro(cfg, arrivals, std::max(cfg.workers, 1), results);
+    } else if (cfg.engine == Engine::Pipeline) {
+        KeyRotator rotator(cfg.rotate_every_ms);
+        PipelineRun run(cfg, arrivals, results);
+        run.run();
+        stages = run.summaries();
+        run.write_depth_csv("pipeline_queues.csv");
+    } else if (cfg.scheduler == Scheduler::Steal) {
+        KeyRotator rotator(cfg.rotate_every_ms);
+        StealRun run(cfg, arrivals, workers, results);
+        const auto &stats = run.run();
+        for (const auto &st : stats) steals += st.steals;
+        imbalance = busy_imbalance(stats);
+    } else {
+        KeyRotator rotator(cfg.rotate_every_ms);
+        std::vector<std::thread> pool;
+        pool.reserve(workers);
+        for (int i=0;i<workers;++i)
+            pool.emplace_back(worker_func, std::ref(counter), std::cref(cfg), std::cref(arrivals), std::ref(results));
+        for (auto &t : pool) if (t.joinable()) t.join();
     }
-    for (auto &t : pool) if (t.joinable()) t.join();
 
     auto run_end = std::chrono::high_resolution_clock::now();
-    double run_total_s = std::chrono::duration_cast<std::chrono::duration<double>>(run_end - run_start).count();
-
-    // compute aggregated stats
-    std::vector<long long> totals;
-    int success_cnt = 0, drop_cnt = 0;
-    for (const auto &m : results) {
-        if (m.dropped) ++drop_cnt;
-        else totals.push_back(m.total_us);
-        if (m.success) ++success_cnt;
-    }
+    double host_total_s = std::chrono::duration_cast<std::chrono::duration<double>>(run_end - run_start).count();
+    // Under des the run time that matters is the simulated one; the host time is just how long the model took
+    double run_total_s = (cfg.engine == Engine::Des) ? sim_total_s : host_total_s;
 
-    long long avg_total = totals.empty() ? 0 : std::accumulate(totals.begin(), totals.end(), 0LL) / (long long)totals.size();
-    long long min_total = totals.empty() ? 0 : *std::min_element(totals.begin(), totals.end());
-    long long max_total = totals.empty() ? 0 : *std::max_element(totals.begin(), totals.end());
-    long long med_total = median_of_vec(totals);
-    double success_pct = results.empty() ? 0.0 : (100.0 * success_cnt / (double)cfg.nodes);
-    double drop_pct = results.empty() ? 0.0 : (100.0 * drop_cnt / (double)cfg.nodes);
+    RunSummary summary = cfg.stats == StatsMode::Stream ? summarize_stream(g_stream_stats.merged(), run_total_s)
+                                                        : summarize(results, run_total_s, g_latency.merged());
+    summary.key_setup_ms = key_setup_ms;
+    summary.key_directory_bytes = key_directory_bytes;
+    summary.key_rotations = g_key_rotations.load();
+    summary.stale_epoch_rejects = g_stale_epoch_rejects.load();
+    summary.steals = steals;
+    summary.busy_imbalance = imbalance;
+    summary.stages = stages;
 
-    // append_perf_csv(cfg.nodes, workers, avg_total, min_total, max_total, med_total, success_pct, drop_pct, run_total_s, cfg.out_file);
+    append_perf_csv(cfg.nodes, workers, summary, cfg.out_file);
 
     // Write human-readable summary to tps.txt
-    write_summary_txt(cfg.nodes, workers, avg_total, min_total, max_total, med_total, success_pct, drop_pct, run_total_s, "tps.txt");
+    write_summary_txt(cfg, workers, summary, "tps.txt");
+    if (cfg.stats == StatsMode::Exact) write_phase_csv(results, cfg.phase_csv);
 
-    cout << "Done. Avg node time: " << (avg_total/1000.0) << " ms, Success: " << success_pct << "%, Dropped: " << drop_pct << "%, Wall time: " << run_total_s << " s\n";
-    cout << "Results written to: " << cfg.out_file << " and tps.txt" << endl;
+    cout << "Done. Avg node time: " << (summary.avg_us/1000.0) << " ms, Avg request time: " << (summary.avg_request_us/1000.0)
+         << " ms, Success: " << summary.success_pct << "%, Dropped: " << summary.drop_pct << "%, TA issues: " << summary.ta_issues
+         << "/" << summary.requests << " requests, Allocs/request: " << summary.allocs_per_request << ", Wall time: " << run_total_s << " s\n";
+    if (cfg.engine == Engine::Des) cout << "Host time for des run: " << host_total_s << " s\n";
+    if (cfg.engine == Engine::Pipeline) {
+        cout << std::left << std::setw(8) << "stage" << std::right << std::setw(9) << "workers" << std::setw(10) << "items" << std::setw(10) << "util %"
+             << std::setw(14) << "wait avg ms" << std::setw(14) << "wait max ms" << std::setw(12) << "depth avg" << std::setw(11) << "depth max" << "\n";
+        for (const auto &st : stages) {
+            cout << std::left << std::setw(8) << st.name << std::right << std::setw(9) << st.workers << std::setw(10) << st.items
+                 << std::fixed << std::setprecision(1) << std::setw(10) << 100.0 * st.utilization << std::setprecision(3)
+                 << std::setw(14) << st.avg_wait_us / 1000.0 << std::setw(14) << st.max_wait_us / 1000.0
+                 << std::setprecision(1) << std::setw(12) << st.avg_depth << std::setw(11) << st.max_depth << "\n";
+        }
+        cout << std::defaultfloat << std::setprecision(6) << "Queue depths over time written to: pipeline_queues.csv\n";
+    }
+    cout << "Mean time per node by phase (ms):";
+    for (int p = 0; p <= PHASE_COUNT; ++p)
+        cout << " " << (p < PHASE_COUNT ? PHASE_NAMES[p] : "other") << " " << std::fixed << std::setprecision(3) << summary.phases[p].mean_us / 1000.0;
+    cout << std::defaultfloat << std::setprecision(6) << "\n";
+    cout << "Node time p50 / p99 / p99.9: " << summary.med_us / 1000.0 << " / " << summary.p99_us / 1000.0 << " / " << summary.p999_us / 1000.0
+         << " ms (" << summary.quantile_method << ", within " << std::fixed << std::setprecision(3) << 100.0 * summary.quantile_error << " %)\n"
+         << std::defaultfloat << std::setprecision(6);
+    if (cfg.stats == StatsMode::Exact) cout << "Results written to: " << cfg.out_file << ", " << cfg.phase_csv << " and tps.txt" << endl;
+    else cout << "Results written to: " << cfg.out_file << " and tps.txt (no " << cfg.phase_csv << " under --stats stream)" << endl;
     return 0;
 }